@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <cstdio>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -7,12 +8,11 @@
 #include <sys/stat.h>
 
 #include "cryptfile.hh"
+#include "slab.hh"
 
 using std::size_t;
 using std::uint8_t;
 
-using Buffer = std::unique_ptr<uint8_t[]>;
-
 CryptFile::CryptFile(Key key, std::string path)
     : pread_bytes(0), pwrite_bytes(0),
       fd_(open(path.c_str(), O_RDWR|O_CREAT, 0666))
@@ -43,7 +43,7 @@ CryptFile::file_size()
 int
 CryptFile::aligned_pread(void *dst, size_t len, size_t offset)
 {
-    Buffer buf(new uint8_t[len]);
+    SlabBuffer buf(page_slab(), len);
     int n = ::pread(fd_, buf.get(), len, offset);
     if (n <= 0)
 	return n;
@@ -56,8 +56,28 @@ CryptFile::aligned_pread(void *dst, size_t len, size_t offset)
 int
 CryptFile::aligned_pwrite(const void *src, size_t len, size_t offset)
 {
-    Buffer buf(new uint8_t[len]);
+    SlabBuffer buf(page_slab(), len);
     crypt_.encrypt(buf.get(), static_cast<const uint8_t*>(src), len, offset);
     pwrite_bytes += len;
     return ::pwrite(fd_, buf.get(), len, offset);
 }
+
+int
+CryptFile::aligned_pwritev(const struct iovec *iov, int iovcnt, size_t offset)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    // Each buffer is encrypted into its own segment of buf, and the
+    // segments are handed to pwritev as they are.
+    SlabBuffer buf(page_slab(), len);
+    std::vector<struct iovec> ct(iovcnt);
+    size_t pos = 0;
+    for (int i = 0; i < iovcnt; pos += iov[i++].iov_len) {
+        ct[i] = {buf.get() + pos, iov[i].iov_len};
+        crypt_.encrypt(buf.get() + pos, static_cast<const uint8_t*>(iov[i].iov_base),
+                       iov[i].iov_len, offset + pos);
+    }
+    pwrite_bytes += len;
+    return ::pwritev(fd_, ct.data(), iovcnt, offset);
+}
@@ -1,6 +1,10 @@
 
 #pragma once
 
+#include <atomic>
+
+#include <sys/uio.h>
+
 #include "crypto.hh"
 #include "vm.hh"
 
@@ -26,10 +30,16 @@ public:
     // Encrypt and write data to the file at position offset.  Both len
     // and offset must be multiples of blocksize.
     int aligned_pwrite(const void *src, std::size_t len, std::size_t offset);
+
+    // Like aligned_pwrite, but gathers the data to write from iovcnt
+    // buffers, as pwritev(2) does.  Every buffer's length must be a
+    // multiple of blocksize.
+    int aligned_pwritev(const struct iovec *iov, int iovcnt, std::size_t offset);
     
-    // I/O statistics (for tests).
-    int pread_bytes;
-    int pwrite_bytes;
+    // I/O statistics (for tests).  Atomic because paging I/O may be
+    // issued from several faulting threads at once.
+    std::atomic<int> pread_bytes;
+    std::atomic<int> pwrite_bytes;
 
 protected:
     unique_fd fd_;              // fd for file containing ciphertext
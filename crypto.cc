@@ -7,6 +7,7 @@
 #include <openssl/err.h>
 
 #include "crypto.hh"
+#include "slab.hh"
 
 using std::uint8_t;
 using std::size_t;
@@ -68,7 +69,8 @@ void
 PageCrypter::encrypt(uint8_t *dst, const uint8_t *src,
 		     size_t len, size_t offset)
 {
-    std::unique_ptr<uint8_t[]> buf = tweaks(offset, len);
+    SlabBuffer buf(page_slab(), len);
+    tweaks(buf.get(), offset, len);
     xorbuf(dst, src, buf.get(), len);
 
     CipherCtx ctx{EVP_CIPHER_CTX_new()};
@@ -86,13 +88,16 @@ void
 PageCrypter::decrypt(uint8_t *dst, const uint8_t *src,
 		     size_t len, size_t offset)
 {
-    std::unique_ptr<uint8_t[]> buf = tweaks(offset, len);
+    SlabBuffer buf(page_slab(), len);
+    tweaks(buf.get(), offset, len);
     xorbuf(dst, src, buf.get(), len);
 
     CipherCtx ctx{EVP_CIPHER_CTX_new()};
     if (EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), nullptr, key_.data(),
 			   nullptr) != 1)
 	crypto_raise("EVP_DecryptInit_ex(aes_128_ecb)");
+    // Otherwise the last block is held back in case it is padding.
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
     int outl;
     if (EVP_DecryptUpdate(ctx, dst, &outl, dst, len) != 1)
 	crypto_raise("EVP_DecryptUpdate(aes_128_ecb)");
@@ -100,13 +105,12 @@ PageCrypter::decrypt(uint8_t *dst, const uint8_t *src,
     xorbuf(dst, dst, buf.get(), len);
 }
 
-std::unique_ptr<uint8_t[]>
-PageCrypter::tweaks(size_t offset, size_t len)
+void
+PageCrypter::tweaks(uint8_t *res, size_t offset, size_t len)
 {
     if (offset % blocksize || len % blocksize)
 	throw std::domain_error
 	    ("PageCrypter must operate at multiples of cipher block_size");
-    std::unique_ptr<uint8_t[]> res(new uint8_t[len]);
     for (size_t i = 0; i < len; i += blocksize) {
 	size_t blockno = (offset + i) / blocksize;
 	for (size_t j = blocksize; j-- > 0; blockno >>= 8)
@@ -118,8 +122,6 @@ PageCrypter::tweaks(size_t offset, size_t len)
 			   nullptr) != 1)
 	crypto_raise("EVP_EncryptInit_ex(aes_128_ecb)");
     int outl;
-    if (EVP_EncryptUpdate(ctx, res.get(), &outl, res.get(), len) != 1)
+    if (EVP_EncryptUpdate(ctx, res, &outl, res, len) != 1)
 	crypto_raise("EVP_EncryptUpdate(aes_128_ecb)");
-
-    return res;
 }
@@ -81,5 +81,6 @@ struct PageCrypter {
 		 std::size_t len, std::size_t offset);
 
 private:
-    std::unique_ptr<std::uint8_t[]> tweaks(std::size_t offset, std::size_t len);
+    // Compute the len bytes of XEX tweaks for data at offset into res.
+    void tweaks(std::uint8_t *res, std::size_t offset, std::size_t len);
 };
@@ -1,149 +1,1498 @@
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
 #include "mcryptfile.hh"
+#include "slab.hh"
 #include "vm.hh"
 
 // Initialize some static MCryptFile variables
 std::size_t MCryptFile::phys_npages = 1000;
-ilist<&PagedVRegion::PTE::list_link> MCryptFile::currentPTEs;
-PagedVRegion::PTE *MCryptFile::clock_curr = nullptr;
+std::size_t MCryptFile::max_phys_npages = 0;
+std::size_t MCryptFile::nframes = 0;
+std::size_t MCryptFile::pressure_min_npages = 0;
+unique_fd MCryptFile::pressure_fd;
+std::mutex MCryptFile::resize_lock;
+std::size_t MCryptFile::cluster_pages = 1;
+PoolOptions MCryptFile::pool_options;
+bool MCryptFile::sector_writeback = false;
+std::size_t MCryptFile::map_reserve = std::size_t(1) << 30;
+std::unique_ptr<SharedCache> MCryptFile::shared_cache;
+std::map<std::pair<dev_t, ino_t>, PagedVRegion *> MCryptFile::caches;
+std::mutex MCryptFile::caches_lock;
+FrameTable MCryptFile::frames;
+PPage MCryptFile::zero_page = nullptr;
+std::mutex MCryptFile::zero_lock;
+MCryptFile::Tracking MCryptFile::tracking = MCryptFile::Tracking::MPROTECT;
+FaultDelivery MCryptFile::delivery = FaultDelivery::SIGNAL;
+std::unique_ptr<MCryptFile::ClockShard[]> MCryptFile::shards;
+std::size_t MCryptFile::nshards = 0;
+std::size_t MCryptFile::shard_frames = 0;
 // Doesn't allocate, simply initializes MCryptFile::pm so PagedVRegion can access it
 PhysMem *MCryptFile::pm = nullptr;
 
-PagedVRegion::PTE::PTE(VPage vp0, Prot p, VPage vr)
-  : vp(vp0), pp(MCryptFile::pm->page_alloc()), vr(vr)
+void
+FrameTable::init(std::size_t nframes, std::size_t nsectors)
 {
-    if (!pp) throw std::runtime_error("Not enough PhysMem pages.");
-    protect(p);
+	state.reset(new std::uint8_t[nframes]());
+	on_clock.reset(new bool[nframes]());
+	owner.reset(new PagedVRegion *[nframes]());
+	vpn.reset(new std::uint32_t[nframes]());
+	if (nsectors)
+		sector_hash.reset(new std::uint64_t[nframes * nsectors]);
+	frame_sectors = nsectors;
 }
 
 
-PagedVRegion::PTE::~PTE()
+PagedVRegion::PageTable::PageTable(std::size_t npages)
+  : npages_(npages), leaves_((npages + leaf_size - 1) / leaf_size),
+	dirty_leaves_((leaves_.size() + 63) / 64)
+{
+	// Page indices are stored in FrameTable::vpn
+	if (npages > std::numeric_limits<std::uint32_t>::max())
+		throw std::length_error("PagedVRegion: region too large");
+}
+
+void
+PagedVRegion::PageTable::set(std::size_t i, Frame f)
 {
-    VMRegion::unmap(vp);
-    MCryptFile::pm->page_free(pp);
+	assert(i < npages_);
+	std::unique_ptr<Leaf> &leaf = leaves_[i >> leaf_bits];
+	if (!leaf) {
+		leaf.reset(new Leaf());
+		std::fill(leaf->frames, leaf->frames + leaf_size, no_frame);
+	}
+	set_dirty(i, false);
+	leaf->frames[i & (leaf_size - 1)] = f;
 }
 
 void
-PagedVRegion::PTE::protect(Prot p)
+PagedVRegion::PageTable::set_dirty(std::size_t i, bool d)
+{
+	std::size_t l = i >> leaf_bits;
+	Leaf &leaf = *leaves_[l];
+	std::uint64_t &w = leaf.dirty[(i & (leaf_size - 1)) / 64];
+	std::uint64_t bit = std::uint64_t(1) << (i % 64);
+	if (d) {
+		w |= bit;
+		dirty_leaves_[l / 64] |= std::uint64_t(1) << (l % 64);
+	} else if (w & bit) {
+		w &= ~bit;
+		if (std::all_of(leaf.dirty, leaf.dirty + leaf_size / 64,
+						[](std::uint64_t x) { return x == 0; }))
+			dirty_leaves_[l / 64] &= ~(std::uint64_t(1) << (l % 64));
+	}
+}
+
+std::size_t
+PagedVRegion::PageTable::next(std::size_t i) const
+{
+	while (i < npages_) {
+		const Leaf *leaf = leaves_[i >> leaf_bits].get();
+		if (!leaf) {
+			// Skip the whole unallocated leaf
+			i = (i | (leaf_size - 1)) + 1;
+			continue;
+		}
+		if (leaf->frames[i & (leaf_size - 1)] != no_frame)
+			return i;
+		i++;
+	}
+	return npages_;
+}
+
+std::size_t
+PagedVRegion::PageTable::next_dirty(std::size_t i) const
 {
-    prot = p;
-    VMRegion::map(vp, pp, prot);
-    if (prot & PROT_READ) accessed = true;
-    if (prot & PROT_WRITE) dirty = true;
+	while (i < npages_) {
+		// Find the first leaf at or after i's with any dirty entries.
+		std::size_t l = i >> leaf_bits;
+		std::uint64_t w = dirty_leaves_[l / 64] & (~std::uint64_t(0) << (l % 64));
+		if (!w) {
+			i = (l / 64 + 1) * 64 << leaf_bits;
+			continue;
+		}
+		std::size_t dl = l / 64 * 64 + __builtin_ctzll(w);
+		if (dl != l)
+			i = dl << leaf_bits;
+		// Then the first dirty entry at or after i within it.
+		const Leaf &leaf = *leaves_[dl];
+		std::size_t k = (i & (leaf_size - 1)) / 64;
+		std::uint64_t d = leaf.dirty[k] & (~std::uint64_t(0) << (i % 64));
+		while (!d && ++k < leaf_size / 64)
+			d = leaf.dirty[k];
+		if (d)
+			return (dl << leaf_bits) + k * 64 + __builtin_ctzll(d);
+		i = (dl + 1) << leaf_bits;
+	}
+	return npages_;
 }
 
 
 PagedVRegion::~PagedVRegion()
 {
-    PTE *lpte = pt.lower_bound(get_base());
-    PTE *end = pt.upper_bound(get_base() + size());
-    while (lpte != end) {
-		if (lpte == MCryptFile::clock_curr)	 // Advance clock hand if we are going to remove the page it's on
-			MCryptFile::clock_curr = MCryptFile::currentPTEs.next(MCryptFile::clock_curr);
-        PTE *to_delete = lpte;
-        lpte = pt.next(lpte);
-		delete to_delete;
-    }
+	discard(0);
 }
 
+VMRegion *
+PagedVRegion::attach(MCryptFile *f, std::size_t n, FaultDelivery delivery)
+{
+	std::size_t cluster_bytes = MCryptFile::cluster_bytes();
+	std::unique_ptr<VMRegion> vmem(
+		new VMRegion(pt.size() * cluster_bytes, fault, f, delivery, cluster_bytes));
+	VMRegion *r = vmem.get();
+	std::unique_lock<std::mutex> lk(pt_lock);
+	// Pages are mapped the same way in every region, so the new one
+	// starts with what the others have.
+	MCryptFile::map_view(this, *r);
+	mappings.push_back({f, std::move(vmem)});
+	nbytes = std::max<std::size_t>(nbytes, n);
+	return r;
+}
+
+void
+PagedVRegion::unmap_all()
+{
+	std::unique_lock<std::mutex> lk(pt_lock);
+	unmap_all(lk);
+}
 
-void MCryptFile::VMhandler(char *va) {
-	VPage vp = va - std::uintptr_t(va) % get_page_size();
-	PagedVRegion::PTE *pte = pvreg->pt[vp];
-	if (!pte) {
-		// Clock algorithm begins here if true
-		if (!pm->nfree()) {
-			// Start clock at the first entry of the circular list
-			while (true) {	// Can be logically replaced by a for loop of at most npages + 1 iterations (Clock hand makes a full cycle)
-				clock_curr = clock_curr ? clock_curr : currentPTEs.front();	// Resets clock hand if for whatever reason it's pointing at null
-				if (!clock_curr) throw std::runtime_error("No page table entries.");
-				if (!clock_curr->accessed) {	// Evicts page if accessed bit cleared
-					if (clock_curr->dirty) {	// Flush page if dirty
-						clock_curr->protect(PROT_READ | PROT_WRITE);
-						VPage oldvp = clock_curr->vp;
-						std::size_t offset = static_cast<std::size_t>(std::uintptr_t(oldvp - clock_curr->vr));
-						MCryptFile::aligned_pwrite(oldvp, get_page_size(), offset);
-					}
-					PagedVRegion::PTE *to_delete = clock_curr;
-					clock_curr = currentPTEs.next(clock_curr);
-					delete to_delete;
-					break;
+void
+PagedVRegion::unmap_all(std::unique_lock<std::mutex> &lk)
+{
+	for (std::size_t i = pt.next(0); i < pt.size();) {
+		Frame f = pt.get(i);
+		if (f == zero_frame) {
+			MCryptFile::unmap_zero(this, i);
+			i = pt.next(i + 1);
+			continue;
+		}
+		if (f == filling_frame || MCryptFile::frames.state[f] & FrameTable::BUSY) {
+			// Pages already passed may be faulted back in meanwhile,
+			// so start over.
+			pt_cv.wait(lk);
+			i = pt.next(0);
+			continue;
+		}
+		std::size_t n = 1;
+		while (n < MCryptFile::max_run() && i + n < pt.size()) {
+			Frame g = pt.get(i + n);
+			if (g == no_frame || g == filling_frame || g == zero_frame
+				|| MCryptFile::frames.state[g] & FrameTable::BUSY)
+				break;
+			n++;
+		}
+		// Pick up any stores the kernel has seen since the last
+		// flush, before they become impossible to detect.  Dropping
+		// the mapping is like resetting the accessed indication, so
+		// stores are stopped the same way.
+		for (std::size_t j = i; j < i + n; j++)
+			MCryptFile::harvest(pt.get(j), true);
+		MCryptFile::for_each_region(this, i, n, [n](VMRegion &vmem, VPage va,
+												   VMRegion::PageInfo *pis) {
+			vmem.unmap_range(va, pis, n * MCryptFile::cluster_pages);
+		});
+		i = pt.next(i + n);
+	}
+}
+
+void
+PagedVRegion::detach(MCryptFile *f)
+{
+	std::unique_ptr<VMRegion> vmem;
+	{
+		std::unique_lock<std::mutex> lk(pt_lock);
+		unmap_all(lk);
+		for (auto it = mappings.begin(); it != mappings.end(); ++it) {
+			if (it->file == f) {
+				vmem = std::move(it->vmem);
+				mappings.erase(it);
+				break;
+			}
+		}
+		if (mappings.empty())
+			nbytes = 0;
+	}
+	// VMRegion's destructor waits for faults in progress, which may be
+	// waiting for pt_lock, so it must not be held here.
+	vmem.reset();
+}
+
+void
+PagedVRegion::discard(std::size_t first)
+{
+	std::unique_lock<std::mutex> lk(pt_lock, std::defer_lock);
+	for (;;) {
+		// Take every page off the clock first so no other thread will
+		// choose one of ours for eviction.  This is rare enough that
+		// we simply take every shard lock (in index order).
+		std::vector<std::unique_lock<std::mutex>> sl;
+		for (std::size_t i = 0; i < MCryptFile::nshards; i++)
+			sl.emplace_back(MCryptFile::shards[i].lock);
+		lk.lock();
+		bool busy = false;
+		for (std::size_t i = pt.next(first); i < pt.size(); i = pt.next(i + 1)) {
+			Frame f = pt.get(i);
+			if (f == zero_frame)
+				continue;
+			if (f == filling_frame || MCryptFile::frames.state[f] & FrameTable::BUSY)
+				busy = true;
+			else
+				MCryptFile::frames.on_clock[f] = false;
+		}
+		sl.clear();
+		if (!busy)
+			break;
+		// Wait for fills and evictions already in progress to finish.
+		pt_cv.wait(lk);
+		lk.unlock();
+	}
+
+	for (std::size_t i = pt.next(first); i < pt.size();) {
+		if (pt.get(i) == zero_frame) {
+			MCryptFile::unmap_zero(this, i);
+			i = pt.next(i + 1);
+			continue;
+		}
+		std::size_t n = 1;
+		while (n < MCryptFile::max_run() && i + n < pt.size()
+			   && pt.get(i + n) != no_frame && pt.get(i + n) != zero_frame)
+			n++;
+		MCryptFile::release_run(this, i, n);
+		for (std::size_t j = i; j < i + n; j++)
+			pt.set(j, no_frame);
+		i = pt.next(i + n);
+	}
+}
+
+
+void
+PagedVRegion::fault(void *f, char *va, bool write)
+{
+	static_cast<MCryptFile *>(f)->VMhandler(va, write);
+}
+
+void
+MCryptFile::init_pool()
+{
+	std::lock_guard<std::mutex> lk(resize_lock);
+	std::size_t npages = std::max(phys_npages, max_phys_npages);
+	nframes = std::max<std::size_t>(1, (npages + cluster_pages - 1) / cluster_pages);
+	if (nframes >= zero_frame)
+		throw std::length_error("MCryptFile: memory pool too large");
+	if (shared_cache && shared_cache->cluster_bytes() != cluster_bytes())
+		throw std::invalid_argument("MCryptFile: shared cache has a different cluster size");
+	// Hugetlb pages can only be mapped whole, so each cluster must
+	// cover whole huge pages.
+	std::size_t hsize = PhysMem::huge_page_size();
+	if (!hsize || cluster_bytes() % hsize)
+		pool_options.huge_pages = false;
+	static PhysMem p(nframes * cluster_pages, pool_options);
+	// Created after the pool, so destroyed (returning the pages of
+	// files no longer mapped) before the pool is.
+	static struct CacheReaper {
+		~CacheReaper() {
+			std::lock_guard<std::mutex> lk(caches_lock);
+			for (auto it = caches.begin(); it != caches.end();) {
+				if (it->second && !it->second->users) {
+					delete it->second;
+					it = caches.erase(it);
 				} else {
-					clock_curr->clear_accessed();
-					clock_curr = currentPTEs.next(clock_curr);
+					++it;
 				}
 			}
 		}
-		
-		pte = new PagedVRegion::PTE(vp, PROT_READ | PROT_WRITE, pvreg->get_base());
-		currentPTEs.push_back(pte);
-		pvreg->pt.insert(pte);
-		std::size_t offset = static_cast<std::size_t>(std::uintptr_t(vp - pte->vr));
-		aligned_pread(vp, get_page_size(), offset);		// Read data into page
-		pte->clear_accessed();
-		pte->dirty = false;
+	} reaper;
+	// Clusters with no data are read through zero_page, which has a
+	// pool of its own so it doesn't count against the memory size.
+	static struct ZeroPage {
+		PhysMem pool;
+		ZeroPage() : pool(cluster_pages) {
+			zero_page = pool.page_alloc(cluster_pages);
+			memset(zero_page, 0, cluster_bytes());
+		}
+		~ZeroPage() { pool.page_free(zero_page); }
+	} zp;
+	p.set_limit(std::max<std::size_t>(1, (phys_npages + cluster_pages - 1)
+									  / cluster_pages) * cluster_pages);
+	frames.init(nframes, sector_writeback ? cluster_bytes() / sector_size : 0);
+	if (tracking == Tracking::PAGEMAP && !VMRegion::tracking_supported())
+		tracking = Tracking::MPROTECT;
+
+	std::size_t ncpu = std::max(1u, std::thread::hardware_concurrency());
+	nshards = std::max<std::size_t>(1, std::min(ncpu, nframes / min_shard_frames));
+	shard_frames = std::max<std::size_t>(1, (nframes + nshards - 1) / nshards);
+	shards.reset(new ClockShard[nshards]);
+
+	// Each page of paging I/O needs two page-sized scratch buffers
+	// (ciphertext and XEX tweaks), and there can be no more I/Os in
+	// flight than there are frames, or than a few per CPU.  (Larger
+	// clusters use ordinary heap buffers.)
+	if (cluster_pages == 1)
+		page_slab().reserve(2 * std::min(nframes, 4 * ncpu));
+	for (std::size_t i = 0; i < nshards; i++) {
+		ClockShard &s = shards[i];
+		s.begin = s.hand = Frame(std::min(i * shard_frames, nframes));
+		s.end = Frame(std::min((i + 1) * shard_frames, nframes));
+	}
+	pm = &p;
+	if (pressure_min_npages)
+		watch_pressure();
+}
+
+void
+MCryptFile::prune_caches()
+{
+	for (auto it = caches.begin(); it != caches.end();) {
+		PagedVRegion *c = it->second;
+		// Pages only come back through faults, and regions nobody
+		// has mapped can't take any.
+		if (c && !c->users && c->empty()) {
+			delete c;
+			it = caches.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+unsigned
+MCryptFile::cpu_shard()
+{
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : unsigned(cpu) % nshards;
+}
+
+std::size_t
+MCryptFile::io_bytes(PagedVRegion *pvr, std::size_t first, std::size_t n)
+{
+	std::size_t end = (pvr->nbytes + get_page_size() - 1) / get_page_size() * get_page_size();
+	return std::min(n * cluster_bytes(), end - first * cluster_bytes());
+}
+
+void
+MCryptFile::set_prot(Frame f, Prot p)
+{
+	std::uint8_t &st = frames.state[f];
+	PPage pp = frame_page(f);
+	VMRegion::PageInfo pis[max_cluster_pages];
+	PPage pas[max_cluster_pages];
+	for (std::size_t i = 0; i < cluster_pages; i++)
+		pas[i] = pp + i * get_page_size();
+	bool track = tracking == Tracking::PAGEMAP && !(st & FrameTable::MAPPED);
+	Prot old = Prot(st & FrameTable::PROT_MASK);
+	for (PagedVRegion::Mapping &m : frames.owner[f]->mappings) {
+		VPage va = m.vmem->get_base() + frame_offset(f);
+		for (std::size_t i = 0; i < cluster_pages; i++)
+			pis[i] = {st & FrameTable::MAPPED ? pas[i] : nullptr, old};
+		if (track) {
+			// Other threads can store to the pages as soon as they
+			// are writable, so they must be tracked before that.
+			m.vmem->map_range(va, pis, pas, p & ~PROT_WRITE, cluster_pages);
+			VMRegion::track(va, cluster_pages);
+		}
+		m.vmem->map_range(va, pis, pas, p, cluster_pages);
+	}
+	st = (st & ~FrameTable::PROT_MASK) | FrameTable::MAPPED | p;
+}
+
+void
+MCryptFile::protect(Frame f, Prot p)
+{
+	set_prot(f, p);
+	if (p & PROT_READ) frames.state[f] |= FrameTable::ACCESSED;
+	if (p & PROT_WRITE && tracking == Tracking::MPROTECT)
+		mark_dirty(f);
+}
+
+void
+MCryptFile::harvest(Frame f, bool reset_accessed)
+{
+	std::uint8_t &st = frames.state[f];
+	if (tracking != Tracking::PAGEMAP || !(st & FrameTable::PROT_MASK))
+		return;
+	// A store through any handle's mapping dirties the page.
+	bool accessed = false;
+	for (PagedVRegion::Mapping &m : frames.owner[f]->mappings) {
+		VMRegion::Usage u = VMRegion::harvest(m.vmem->get_base() + frame_offset(f),
+											  cluster_pages, false);
+		accessed |= u.accessed;
+		if (u.dirty) mark_dirty(f);
+	}
+	if (accessed) st |= FrameTable::ACCESSED;
+	if (!reset_accessed || !accessed)
+		return;
+	// Resetting the accessed indication drops the kernel's mapping,
+	// which would lose a store slipping in after the scan, so stop
+	// stores first and look once more.  The next store faults and
+	// gets write access back.
+	if (st & PROT_WRITE)
+		set_prot(f, PROT_READ);
+	for (PagedVRegion::Mapping &m : frames.owner[f]->mappings) {
+		if (VMRegion::harvest(m.vmem->get_base() + frame_offset(f),
+							  cluster_pages, true).dirty)
+			mark_dirty(f);
+	}
+}
+
+void
+MCryptFile::map_zero(PagedVRegion *pvr, std::size_t i)
+{
+	PPage pas[max_cluster_pages];
+	VMRegion::PageInfo pis[max_cluster_pages];
+	for (std::size_t j = 0; j < cluster_pages; j++)
+		pas[j] = zero_page + j * get_page_size();
+	std::lock_guard<std::mutex> zl(zero_lock);
+	for (PagedVRegion::Mapping &m : pvr->mappings) {
+		std::fill(pis, pis + cluster_pages, VMRegion::PageInfo{});
+		m.vmem->map_range(m.vmem->get_base() + i * cluster_bytes(), pis, pas,
+						  PROT_READ, cluster_pages);
+	}
+	pvr->pt.set(i, zero_frame);
+}
+
+void
+MCryptFile::unmap_zero(PagedVRegion *pvr, std::size_t i)
+{
+	VMRegion::PageInfo pis[max_cluster_pages];
+	std::lock_guard<std::mutex> zl(zero_lock);
+	for (PagedVRegion::Mapping &m : pvr->mappings) {
+		for (std::size_t j = 0; j < cluster_pages; j++)
+			pis[j] = {zero_page + j * get_page_size(), PROT_READ};
+		m.vmem->unmap_range(m.vmem->get_base() + i * cluster_bytes(), pis, cluster_pages);
+	}
+	pvr->pt.set(i, no_frame);
+}
+
+void
+MCryptFile::map_view(PagedVRegion *pvr, VMRegion &vmem)
+{
+	PPage pas[max_cluster_pages];
+	VMRegion::PageInfo pis[max_cluster_pages];
+	PagedVRegion::PageTable &pt = pvr->pt;
+	for (std::size_t i = pt.next(0); i < pt.size(); i = pt.next(i + 1)) {
+		Frame f = pt.get(i);
+		VPage va = vmem.get_base() + i * cluster_bytes();
+		std::fill(pis, pis + cluster_pages, VMRegion::PageInfo{});
+		if (f == zero_frame) {
+			for (std::size_t j = 0; j < cluster_pages; j++)
+				pas[j] = zero_page + j * get_page_size();
+			std::lock_guard<std::mutex> zl(zero_lock);
+			vmem.map_range(va, pis, pas, PROT_READ, cluster_pages);
+			continue;
+		}
+		// Frames still being filled are mapped in every region
+		// (this one included) once they are done.
+		if (f == filling_frame || !(frames.state[f] & FrameTable::MAPPED))
+			continue;
+		Prot p = Prot(frames.state[f] & FrameTable::PROT_MASK);
+		for (std::size_t j = 0; j < cluster_pages; j++)
+			pas[j] = frame_page(f) + j * get_page_size();
+		// As in set_prot, track stores before allowing any.
+		if (tracking == Tracking::PAGEMAP) {
+			vmem.map_range(va, pis, pas, p & ~PROT_WRITE, cluster_pages);
+			VMRegion::track(va, cluster_pages);
+		}
+		vmem.map_range(va, pis, pas, p, cluster_pages);
+	}
+}
+
+bool
+MCryptFile::is_hole(std::size_t i)
+{
+	if ((i + 1) * cluster_bytes() <= pvreg->dense_bytes)
+		return false;
+	off_t off = i * cluster_bytes();
+	off_t data = lseek(fd_, off, SEEK_DATA);
+	if (data == -1)
+		return errno == ENXIO;	// No data from off to the end of the file
+	return std::size_t(data) >= off + cluster_bytes();
+}
+
+void
+MCryptFile::get_page_infos(PagedVRegion *pvr, std::size_t first, std::size_t n,
+						   VMRegion::PageInfo *pis)
+{
+	assert(n <= max_run());
+	for (std::size_t i = 0; i < n; i++) {
+		Frame f = pvr->pt.get(first + i);
+		std::uint8_t st = frames.state[f];
+		for (std::size_t j = 0; j < cluster_pages; j++)
+			*pis++ = {st & FrameTable::MAPPED ? frame_page(f) + j * get_page_size() : nullptr,
+					  Prot(st & FrameTable::PROT_MASK)};
+	}
+}
+
+void
+MCryptFile::put_page_infos(PagedVRegion *pvr, std::size_t first, std::size_t n,
+						   const VMRegion::PageInfo *pis)
+{
+	for (std::size_t i = 0; i < n; i++, pis += cluster_pages) {
+		std::uint8_t &st = frames.state[pvr->pt.get(first + i)];
+		st &= ~(FrameTable::MAPPED | FrameTable::PROT_MASK);
+		if (pis->pa)
+			st |= FrameTable::MAPPED | pis->prot;
+	}
+}
+
+template <typename Op>
+void
+MCryptFile::for_each_region(PagedVRegion *pvr, std::size_t first, std::size_t n, Op op)
+{
+	if (pvr->mappings.empty())	// Nothing is mapped
+		return;
+	VMRegion::PageInfo pis[max_run_pages], tmp[max_run_pages];
+	get_page_infos(pvr, first, n, pis);
+	for (PagedVRegion::Mapping &m : pvr->mappings) {
+		std::copy(pis, pis + n * cluster_pages, tmp);
+		op(*m.vmem, m.vmem->get_base() + first * cluster_bytes(), tmp);
+	}
+	put_page_infos(pvr, first, n, tmp);
+}
+
+void
+MCryptFile::set_prot_run(PagedVRegion *pvr, std::size_t first, std::size_t n, Prot p)
+{
+	for_each_region(pvr, first, n, [&](VMRegion &vmem, VPage va, VMRegion::PageInfo *pis) {
+		vmem.protect_range(va, pis, p, n * cluster_pages);
+	});
+}
+
+Frame
+MCryptFile::clear_accessed(Frame f, Frame limit)
+{
+	PagedVRegion *pvr = frames.owner[f];
+	std::size_t n = 1;
+	if (tracking == Tracking::MPROTECT) {
+		// Frames are usually allocated in order as a region is first
+		// touched, so the frames after f often hold the pages after
+		// its page.  Sweep those along with f if they are also due,
+		// revoking access to all of them with one system call.
+		while (n < max_run() && f + n < limit) {
+			Frame g = f + Frame(n);
+			if (!frames.on_clock[g] || frames.owner[g] != pvr
+				|| frames.vpn[g] != frames.vpn[f] + n
+				|| (frames.state[g] & (FrameTable::BUSY | FrameTable::ACCESSED))
+				   != FrameTable::ACCESSED)
+				break;
+			n++;
+		}
+		set_prot_run(pvr, frames.vpn[f], n, PROT_NONE);
+	}
+	for (std::size_t i = 0; i < n; i++)
+		frames.state[f + i] &= ~FrameTable::ACCESSED;
+	return f + Frame(n);
+}
+
+void
+MCryptFile::release_run(PagedVRegion *pvr, std::size_t first, std::size_t n)
+{
+	for_each_region(pvr, first, n, [&](VMRegion &vmem, VPage va, VMRegion::PageInfo *pis) {
+		vmem.unmap_range(va, pis, n * cluster_pages);
+	});
+	for (std::size_t i = 0; i < n; i++) {
+		Frame f = pvr->pt.get(first + i);
+		frames.state[f] = 0;
+		pm->page_free(frame_page(f));
+	}
+}
+
+void
+MCryptFile::unmap_frame(Frame f)
+{
+	PagedVRegion *pvr = frames.owner[f];
+	if (frames.state[f] & FrameTable::MAPPED) {
+		for_each_region(pvr, frames.vpn[f], 1, [](VMRegion &vmem, VPage va,
+												  VMRegion::PageInfo *pis) {
+			vmem.unmap_range(va, pis, cluster_pages);
+		});
+	}
+}
+
+void
+MCryptFile::release(Frame f)
+{
+	unmap_frame(f);
+	frames.state[f] = 0;
+	pm->page_free(frame_page(f));
+}
+
+bool
+MCryptFile::evict_one(ClockShard &s, int *error)
+{
+	std::unique_lock<std::mutex> sl(s.lock);
+	// Two full sweeps are always enough to find an unaccessed page
+	// unless every page is free or busy.
+	std::size_t budget = 2 * std::size_t(s.end - s.begin);
+	while (budget--) {
+		Frame f = s.hand;
+		s.hand = f + 1 == s.end ? s.begin : f + 1;
+		if (!frames.on_clock[f]) continue;
+
+		PagedVRegion *pvr = frames.owner[f];
+		std::unique_lock<std::mutex> lk(pvr->pt_lock);
+		std::uint8_t &st = frames.state[f];
+		if (st & FrameTable::BUSY) continue;
+		harvest(f, true);
+		if (st & FrameTable::ACCESSED) {
+			Frame next = clear_accessed(f, s.end);
+			budget -= std::min<std::size_t>(budget, next - f - 1);
+			s.hand = next == s.end ? s.begin : next;
+			continue;
+		}
+
+		// Evict page since accessed bit cleared.  If it can't be
+		// written back, it stays, and another is chosen.
+		if (evict(f, sl, lk))
+			return true;
+		*error = errno;
+		lk.unlock();
+		sl.lock();
+	}
+	return false;
+}
+
+bool
+MCryptFile::evict(Frame f, std::unique_lock<std::mutex> &sl,
+				  std::unique_lock<std::mutex> &lk)
+{
+	// Once it is off the clock and marked busy, nobody else will touch
+	// the page, so we can drop both locks for the write back.
+	PagedVRegion *pvr = frames.owner[f];
+	std::uint8_t &st = frames.state[f];
+	frames.on_clock[f] = false;
+	st |= FrameTable::BUSY;
+	sl.unlock();
+	if (tracking == Tracking::PAGEMAP && st & PROT_WRITE) {
+		// Stop stores before taking the final look at the dirty bit.
+		set_prot(f, PROT_READ);
+		harvest(f, false);
+	}
+	// Take the page away from the region, so any access faults
+	// and waits for the eviction, and write it back through its
+	// PhysMem address.
+	unmap_frame(f);
+	if (st & FrameTable::DIRTY) {	// Flush page if dirty
+		// Only mapped files have dirty pages.  Any handle mapping the
+		// file will do for the write, and since the page is busy, it
+		// can't detach until the write completes.
+		assert(!pvr->mappings.empty());
+		MCryptFile *file = pvr->mappings.front().file;
+		lk.unlock();
+		struct iovec iov = {frame_page(f), io_bytes(pvr, frames.vpn[f], 1)};
+		if (file->write_back(frames.vpn[f], &iov, 1) < 0) {
+			// Keep the page, still dirty (so a flush tries again and
+			// reports the error), and put it back on the clock, as if
+			// just used.  It is mapped again when next accessed.
+			int err = errno;
+			sl.lock();
+			lk.lock();
+			frames.on_clock[f] = true;
+			st = (st & ~(FrameTable::BUSY | FrameTable::MAPPED | FrameTable::PROT_MASK))
+				| FrameTable::ACCESSED;
+			sl.unlock();
+			pvr->pt_cv.notify_all();
+			errno = err;
+			return false;
+		}
+		lk.lock();
+	}
+	pvr->pt.set(frames.vpn[f], no_frame);
+	release(f);
+	pvr->pt_cv.notify_all();
+	return true;
+}
+
+PPage
+MCryptFile::alloc_frame()
+{
+	for (;;) {
+		if (PPage pp = pm->page_alloc(cluster_pages))
+			return pp;
+		// Reclaim from our own CPU's shard, stealing from the others
+		// only if it has nothing to give.  Another thread may still
+		// grab the page we freed, or all pages may be in the middle of
+		// being filled; either way, try again.
+		unsigned start = cpu_shard();
+		bool evicted = false;
+		int error = 0;
+		for (std::size_t i = 0; i < nshards && !evicted; i++)
+			evicted = evict_one(shards[(start + i) % nshards], &error);
+		// Rather than wait for writes that keep failing, fail the
+		// fault.
+		if (!evicted && error)
+			throw std::system_error(error, std::generic_category(),
+									"MCryptFile: write back");
+		if (!evicted)
+			std::this_thread::yield();
 	}
+}
+
+
+void MCryptFile::VMhandler(char *va, bool write) {
+	++faults;
+	std::size_t i = std::size_t(va - region->get_base()) / cluster_bytes();
+	std::unique_lock<std::mutex> lk(pvreg->pt_lock);
+	if (i * cluster_bytes() >= pvreg->nbytes)
+		throw std::out_of_range("MCryptFile: page fault past the end of the mapping");
+	Frame f;
+	// If another thread is already filling or evicting this page, wait for it.
+	while ((f = pvreg->pt.get(i)) == filling_frame
+		   || (f != no_frame && f != zero_frame && frames.state[f] & FrameTable::BUSY))
+		pvreg->pt_cv.wait(lk);
+	// A store to a cluster with no data gets it a frame.
+	bool need_frame = write;
+	if (f == zero_frame) {
+		// The zero page is readable, so a load here only raced with
+		// mapping it, and can go ahead.  Where the hardware doesn't
+		// say which faults are stores (see FaultHandler), this may be
+		// one, so the cluster gets a frame, but one that only becomes
+		// writable (and dirty) if the access faults again.
+		if (!write && faults_report_writes)
+			return;
+		unmap_zero(pvreg, i);
+		need_frame = true;
+		f = no_frame;
+	}
+	if (f == no_frame) {
+		pvreg->pt.set(i, filling_frame);
+		lk.unlock();
+
+		// Reading a cluster with no data needn't take a frame (or do
+		// any I/O) until it is written.
+		bool hole = is_hole(i);
+		if (hole && !need_frame) {
+			lk.lock();
+			map_zero(pvreg, i);
+			pvreg->pt_cv.notify_all();
+			return;
+		}
+
+		// Read data through the cluster's PhysMem address; its
+		// VPages stay inaccessible until the data is complete, or
+		// other threads could see (and write into) a half-filled page.
+		PPage pp = alloc_frame();
+		int n = hole ? 0 : -1;
+		std::uint64_t gen = 0;
+		if (shared_cache && !hole)
+			n = shared_cache->lookup(shared_tag(pvreg, i), pp, &gen);
+		if (n < 0) {
+			n = aligned_pread(pp, cluster_bytes(), i * cluster_bytes());
+			if (n < 0) threrror("pread");
+			if (shared_cache && n > 0)
+				shared_cache->fill(shared_tag(pvreg, i), pp, n, gen);
+		}
+		// Don't leak the previous contents of the frame past EOF
+		memset(pp + n, 0, cluster_bytes() - n);
+		f = page_frame(pp);
+		if (sector_writeback)
+			hash_sectors(f, n);
+
+		// The frame joins the clock busy, so that the clock leaves it
+		// alone until it is in the page table.
+		frames.owner[f] = pvreg;
+		frames.vpn[f] = std::uint32_t(i);
+		frames.state[f] = FrameTable::BUSY;
+		{
+			ClockShard &s = shard_of(f);
+			std::lock_guard<std::mutex> sl(s.lock);
+			frames.on_clock[f] = true;
+		}
+
+		lk.lock();
+		pvreg->pt.set(i, f);
+		frames.state[f] &= ~FrameTable::BUSY;
+		pvreg->pt_cv.notify_all();
+	}
+	// A store gets a writable mapping straight away rather than
+	// faulting a second time to upgrade a read-only one.  If the
+	// kernel tracks stores for us, every page is mapped writable, and
+	// a page that is dirty anyway might as well be.  Only where the
+	// hardware doesn't say which faults are stores is a fault on a
+	// page already in use taken to be one; elsewhere, that is just a
+	// load that lost a race to map the page.
 	Prot prot = PROT_READ;
-	if (pte->accessed || pte->dirty) prot |= PROT_WRITE;
-	pte->protect(prot);
+	if (write || tracking == Tracking::PAGEMAP
+		|| frames.state[f] & FrameTable::DIRTY
+		|| (!faults_report_writes && frames.state[f] & FrameTable::ACCESSED))
+		prot |= PROT_WRITE;
+	protect(f, prot);
 }
 
 
 MCryptFile::MCryptFile(Key key, std::string path)
-    : CryptFile(key, path), pvreg(nullptr)
+    : CryptFile(key, path), faults(0), pvreg(nullptr), region(nullptr)
 {
     // Empty initializer
 }
 
 MCryptFile::~MCryptFile()
 {
-    unmap();
+    // Write errors can't be reported from here.
+    try {
+        unmap();
+    } catch (const std::system_error &) {
+    }
 }
 
 
 char *
 MCryptFile::map(size_t min_size)
 {	
-	// Allocates PhysMem on first use of map. If statement not necessary but for ideological flow.
-	if (!pm) {
-		static PhysMem p(phys_npages);
-		pm = &p;
-	}
+	// Allocates PhysMem on first use of map.
+	static std::once_flag pool_initialized;
+	std::call_once(pool_initialized, init_pool);
 	while (pvreg != nullptr) unmap();	// Same thing as an if here. If currently mapped, unmap.
-    pvreg = new PagedVRegion(std::max(min_size, file_size()), [this](char *a){ VMhandler(a); });
-	if (!pvreg) throw std::runtime_error("Unable to create VMRegion.");
-    return pvreg->get_base();
+	std::size_t size = std::max(min_size, file_size());
+	std::size_t reserve = std::max(size, map_reserve);
+	struct stat st;
+	if (fstat(fd_, &st) == -1)
+		threrror("fstat");
+
+	// Share the pages of other handles mapping the file, or reuse the
+	// pages left by its last mapping, unless the file has changed since.
+	std::lock_guard<std::mutex> lk(caches_lock);
+	prune_caches();
+	PagedVRegion *&c = caches[{st.st_dev, st.st_ino}];
+	if (c && c->users) {
+		// A second copy of the pages would have each handle's writes
+		// overwrite the other's.
+		if (c->key != crypt_.key_)
+			throw std::invalid_argument("MCryptFile: file already mapped with another key");
+		if (c->pt.size() * cluster_bytes() < size)
+			throw std::length_error("MCryptFile: file already mapped with a smaller reserve");
+		pvreg = c;
+	} else {
+		bool changed = c && (c->file_size != st.st_size
+							 || c->mtime.tv_sec != st.st_mtim.tv_sec
+							 || c->mtime.tv_nsec != st.st_mtim.tv_nsec);
+		// Whatever changed the file may have left other processes'
+		// copies of it stale too.
+		if (changed && shared_cache)
+			shared_cache->invalidate(st.st_dev, st.st_ino);
+		if (c && (changed || c->key != crypt_.key_
+				  || c->pt.size() * cluster_bytes() < reserve)) {
+			delete c;
+			c = nullptr;
+		}
+		if (!c) {
+			c = new PagedVRegion(reserve, cluster_bytes());
+			c->cached = true;
+		}
+		pvreg = c;
+	}
+	if (!pvreg->users) {
+		pvreg->key = crypt_.key_;
+		pvreg->dev = st.st_dev;
+		pvreg->ino = st.st_ino;
+		// A file with as many blocks as bytes has no holes.
+		pvreg->dense_bytes = std::size_t(st.st_blocks) * 512 >= std::size_t(st.st_size)
+			? std::size_t(st.st_size) : 0;
+	}
+	pvreg->users++;
+	region = pvreg->attach(this, size, delivery);
+    return region->get_base();
 }
 
 void
 MCryptFile::unmap()
 {
-    flush();
-	delete pvreg;
+	if (!pvreg) return;
+	// Let asynchronous flushes finish before the region goes away.
+	std::vector<std::shared_future<void>> pending;
+	{
+		std::lock_guard<std::mutex> lk(flushes_lock);
+		pending.swap(flushes);
+	}
+	for (std::shared_future<void> &done : pending)
+		done.wait();
+	// Unmapping the pages stops further stores, so once any that
+	// slipped in are written too, every page is clean (unless other
+	// handles still have the file mapped).  If a write fails, we
+	// still let go of the region, and report the error after.
+	std::exception_ptr error;
+	try {
+		flush();
+		pvreg->unmap_all();
+		flush();
+	} catch (...) {
+		error = std::current_exception();
+	}
+	pvreg->detach(this);
+
+	std::lock_guard<std::mutex> lk(caches_lock);
+	struct stat st;
+	if (--pvreg->users == 0) {
+		// Other handles write back the pages still dirty after a
+		// failure, but if there are none, those pages are lost, and
+		// what remains can't be reused.
+		if (!error && pvreg->cached && fstat(fd_, &st) == 0) {
+			pvreg->file_size = st.st_size;
+			pvreg->mtime = st.st_mtim;
+		} else {
+			if (pvreg->cached)
+				caches.erase({pvreg->dev, pvreg->ino});
+			delete pvreg;
+		}
+	}
 	pvreg = nullptr;
+	region = nullptr;
+	if (error)
+		std::rethrow_exception(error);
 }
 
 
+void
+MCryptFile::resize(std::size_t new_size)
+{
+	if (!pvreg) throw std::runtime_error("MCryptFile is not currently mapped.");
+	if (new_size > region->nbytes_)
+		throw std::length_error("MCryptFile: resize past reserved address space");
+	std::unique_lock<std::mutex> lk(pvreg->pt_lock);
+	std::size_t old_size = pvreg->nbytes;
+	// From here on, faults past the new end are errors.
+	pvreg->nbytes = new_size;
+	if (new_size >= old_size)
+		return;
+	pvreg->dense_bytes = std::min<std::size_t>(pvreg->dense_bytes, new_size);
+
+	// Zero the rest of the last cluster, as if it had been read in
+	// from the truncated file.
+	std::size_t last = new_size / cluster_bytes();
+	Frame f;
+	while ((f = pvreg->pt.get(last)) == filling_frame
+		   || (f != no_frame && f != zero_frame && frames.state[f] & FrameTable::BUSY))
+		pvreg->pt_cv.wait(lk);
+	if (f != no_frame && f != zero_frame) {
+		std::size_t off = new_size % cluster_bytes();
+		memset(frame_page(f) + off, 0, cluster_bytes() - off);
+	}
+	lk.unlock();
+	pvreg->discard((new_size + cluster_bytes() - 1) / cluster_bytes());
+	if (file_size() > new_size && ftruncate(fd_, new_size) == -1)
+		threrror("ftruncate");
+	if (shared_cache)
+		shared_cache->invalidate(pvreg->dev, pvreg->ino, last);
+}
+
 void
 MCryptFile::flush()
 {
-	itree<&PagedVRegion::PTE::vp, &PagedVRegion::PTE::tree_link>& pt = pvreg->pt;
-    PagedVRegion::PTE *cpte = pt.lower_bound(pvreg->get_base());
-    PagedVRegion::PTE *end = pt.upper_bound(pvreg->get_base() + pvreg->size());
-    while (cpte != end) {
-        if (cpte->dirty) {
-			cpte->protect(PROT_READ | PROT_WRITE);
-			VPage vp = cpte->vp;
-			std::size_t offset = static_cast<std::size_t>(std::uintptr_t(vp - cpte->vr));
-			aligned_pwrite(vp, get_page_size(), offset);
-			cpte->dirty = false;
-			cpte->protect(PROT_READ);
-		}
-		cpte = pt.next(cpte);
-    }
+	flush_range(0, SIZE_MAX);
+}
+
+void
+MCryptFile::flush_range(std::size_t offset, std::size_t len)
+{
+	if (!pvreg) return;
+	std::unique_lock<std::mutex> lk(pvreg->pt_lock);
+	if (offset >= pvreg->nbytes) return;
+	len = std::min(len, pvreg->nbytes - offset);
+	std::size_t first = offset / cluster_bytes();
+	std::size_t end = (offset + len + cluster_bytes() - 1) / cluster_bytes();
+	PagedVRegion::PageTable &pt = pvreg->pt;
+	for (PagedVRegion::Mapping &m : pvreg->mappings) {
+		if (tracking != Tracking::PAGEMAP) break;
+		// Add the clusters the kernel has seen stores to, through any
+		// handle's mapping, since it was last asked to the dirty set.
+		char *base = m.vmem->get_base();
+		VMRegion::harvest_dirty(base + first * cluster_bytes(),
+								(end - first) * cluster_pages,
+								[&](VPage va, std::size_t npages) {
+			std::size_t j = std::size_t(va - base) / cluster_bytes();
+			std::size_t e = (std::size_t(va - base) + npages * get_page_size()
+							 + cluster_bytes() - 1) / cluster_bytes();
+			for (; j < e; j++) {
+				Frame f = pt.get(j);
+				if (f != no_frame && f != filling_frame && f != zero_frame)
+					mark_dirty(f);
+			}
+		});
+	}
+
+	// Runs of dirty clusters are encrypted and written by this thread
+	// and up to flush_threads() - 1 helpers in parallel.  Runs that
+	// have been found but that nobody is writing yet wait in queue,
+	// which is protected by pt_lock.  Helpers are only started once
+	// there is more than one run waiting.
+	struct Run { std::size_t first, n; };
+	std::deque<Run> queue;
+	std::size_t writing = 0;	// Runs being written
+	bool scanned = false;		// No more runs will be queued
+	int error = 0;				// errno of the first failed write
+	std::vector<std::thread> helpers;
+	// Write back the first queued run, with lk held.
+	auto write_one = [&](std::unique_lock<std::mutex> &lk) {
+		Run r = queue.front();
+		queue.pop_front();
+		writing++;
+		struct iovec iov[max_run_pages];
+		for (std::size_t j = 0; j < r.n; j++)
+			iov[j] = {frame_page(pt.get(r.first + j)), io_bytes(pvreg, r.first + j, 1)};
+		lk.unlock();
+		bool ok = write_back(r.first, iov, r.n) >= 0;
+		int err = errno;
+		lk.lock();
+		for (std::size_t j = r.first; j < r.first + r.n; j++) {
+			Frame f = pt.get(j);
+			frames.state[f] &= ~FrameTable::BUSY;
+			if (!ok)	// Try again next time
+				frames.state[f] |= FrameTable::DIRTY;
+			pt.set_dirty(j, frames.state[f] & FrameTable::DIRTY);
+		}
+		if (!ok && !error)
+			error = err;
+		writing--;
+		pvreg->pt_cv.notify_all();
+	};
+	auto help = [&] {
+		std::unique_lock<std::mutex> lk(pvreg->pt_lock);
+		for (;;) {
+			if (!queue.empty())
+				write_one(lk);
+			else if (scanned)
+				return;
+			else
+				pvreg->pt_cv.wait(lk);
+		}
+	};
+	// However we leave, tell the helpers that no more runs are coming,
+	// write out with them whatever is still queued, and join them;
+	// a std::thread destroyed while still joinable ends the process.
+	auto finish = [&] {
+		if (scanned && helpers.empty()) return;
+		if (!lk.owns_lock()) lk.lock();
+		scanned = true;
+		pvreg->pt_cv.notify_all();
+		lk.unlock();
+		help();
+		for (std::thread &t : helpers)
+			t.join();
+		helpers.clear();
+	};
+	struct Finisher {
+		decltype(finish) &f;
+		~Finisher() { f(); }
+	} finisher{finish};
+	std::size_t nthreads = flush_threads();
+
+	std::size_t i = pt.next_dirty(first);
+	while (i < end) {
+		Frame f = pt.get(i);
+		if (frames.state[f] & FrameTable::BUSY) {
+			// Being written back or evicted by someone else; wait and
+			// re-check.  Write out our own queued runs first, in case
+			// it's another flush waiting on one of them.
+			if (!queue.empty())
+				write_one(lk);
+			else
+				pvreg->pt_cv.wait(lk);
+			i = pt.next_dirty(i);
+			continue;
+		}
+
+		// Write back the whole run of dirty clusters starting here at once.
+		std::size_t n = 1;
+		while (n < max_run() && i + n < end && pt.dirty(i + n)
+			   && !(frames.state[pt.get(i + n)] & FrameTable::BUSY))
+			n++;
+		// Pages are written back through their PhysMem addresses.
+		// They stay in the dirty set while busy, so that other flushes
+		// wait for the write, but stores from now on mark them dirty
+		// again.  Unless the kernel is recording stores, they must be
+		// write-protected so that stores during the write back fault
+		// and wait, and so we find out about later ones.
+		for (std::size_t j = i; j < i + n; j++) {
+			std::uint8_t &st = frames.state[pt.get(j)];
+			st = (st & ~FrameTable::DIRTY) | FrameTable::BUSY;
+		}
+		if (tracking == Tracking::MPROTECT) {
+			set_prot_run(pvreg, i, n, PROT_READ);
+			for (std::size_t j = i; j < i + n; j++)
+				frames.state[pt.get(j)] |= FrameTable::ACCESSED;
+		}
+		queue.push_back({i, n});
+		if (queue.size() > 1 && helpers.size() + 1 < nthreads) {
+			helpers.emplace_back(help);
+		} else if (queue.size() > 2 * nthreads) {
+			// Enough work is waiting; help with it rather than
+			// marking still more pages busy.
+			write_one(lk);
+		}
+		pvreg->pt_cv.notify_all();
+		i = pt.next_dirty(i + n);
+	}
+	finish();
+	if (error) {
+		errno = error;
+		threrror("pwrite");
+	}
+}
+
+namespace {
+
+// A fast (non-cryptographic) hash of one sector of data.
+std::uint64_t
+hash_sector(const void *sector)
+{
+	const std::uint64_t *w = static_cast<const std::uint64_t *>(sector);
+	// Four independent lanes, to keep the multiplier busy.
+	std::uint64_t h[4] = {0, 1, 2, 3};
+	for (std::size_t i = 0; i < MCryptFile::sector_size / 8; i += 4)
+		for (std::size_t j = 0; j < 4; j++)
+			h[j] = ((h[j] ^ w[i + j]) * 0x9e3779b97f4a7c15) ^ (h[j] >> 29);
+	return (h[0] + (h[1] << 1 | h[1] >> 63)) ^ (h[2] + (h[3] << 1 | h[3] >> 63));
+}
+
+} // anonymous namespace
+
+void
+MCryptFile::hash_sectors(Frame f, std::size_t nbytes)
+{
+	PPage pp = frame_page(f);
+	std::uint64_t *h = frames.sector_hashes(f);
+	static const std::uint64_t zero_hash = hash_sector(std::string(sector_size, '\0').data());
+	for (std::size_t s = 0; s < frames.frame_sectors; s++)
+		h[s] = (s + 1) * sector_size <= nbytes ? hash_sector(pp + s * sector_size)
+											   : ~zero_hash;
+}
+
+int
+MCryptFile::write_back(std::size_t first, const struct iovec *iov, std::size_t n)
+{
+	// With PAGEMAP tracking the pages may be stored to while they are
+	// encrypted, so write (and share) a copy, so that the shared cache
+	// gets exactly what went to the file.
+	std::unique_ptr<SlabBuffer> buf;
+	struct iovec copy[max_run_pages];
+	if (shared_cache && !sector_writeback && tracking == Tracking::PAGEMAP) {
+		std::size_t len = 0;
+		for (std::size_t j = 0; j < n; j++)
+			len += iov[j].iov_len;
+		buf.reset(new SlabBuffer(page_slab(), len));
+		for (std::size_t j = 0, pos = 0; j < n; pos += iov[j++].iov_len) {
+			memcpy(buf->get() + pos, iov[j].iov_base, iov[j].iov_len);
+			copy[j] = {buf->get() + pos, iov[j].iov_len};
+		}
+		iov = copy;
+	}
+
+	int result;
+	if (sector_writeback) {
+		result = write_sectors(first, iov, n);
+	} else {
+		std::size_t len = 0;
+		for (std::size_t j = 0; j < n; j++)
+			len += iov[j].iov_len;
+		result = aligned_pwritev(iov, int(n), first * cluster_bytes());
+		// A short write leaves the rest of the data unwritten.
+		if (result >= 0 && std::size_t(result) < len) {
+			errno = EIO;
+			result = -1;
+		}
+	}
+	if (shared_cache) {
+		// With sector write back, other processes' changes to the rest
+		// of the cluster may be in the file but not in our copy.
+		int err = errno;
+		for (std::size_t j = 0; j < n; j++) {
+			SharedCache::Tag t = shared_tag(pvreg, first + j);
+			if (result < 0 || sector_writeback)
+				shared_cache->invalidate(t);
+			else
+				shared_cache->update(t, iov[j].iov_base, iov[j].iov_len);
+		}
+		errno = err;
+	}
+	return result;
+}
+
+int
+MCryptFile::write_sectors(std::size_t first, const struct iovec *iov, std::size_t n)
+{
+	std::size_t offset = first * cluster_bytes();
+
+	// The pages may still be written to (with PAGEMAP tracking), so
+	// work from a copy, to be sure that what we write is what we
+	// hashed.  Each run of changed sectors takes one write.
+	std::size_t len = 0;
+	for (std::size_t j = 0; j < n; j++)
+		len += iov[j].iov_len;
+	SlabBuffer buf(page_slab(), len);
+	std::size_t pos = 0, start = 0;
+	int result = 0;
+	auto write_run = [&] {
+		int r = aligned_pwrite(buf.get() + start, pos - start, offset + start);
+		if (r >= 0 && std::size_t(r) < pos - start)
+			errno = EIO;		// Short write
+		if (r < 0 || std::size_t(r) < pos - start)
+			result = -1;
+	};
+	for (std::size_t j = 0; j < n; j++) {
+		std::uint64_t *h = frames.sector_hashes(page_frame(static_cast<PPage>(iov[j].iov_base)));
+		for (std::size_t s = 0; s * sector_size < iov[j].iov_len; s++, pos += sector_size) {
+			std::uint8_t *copy = buf.get() + pos;
+			memcpy(copy, static_cast<char *>(iov[j].iov_base) + s * sector_size, sector_size);
+			std::uint64_t hash = hash_sector(copy);
+			if (hash != h[s]) {
+				h[s] = hash;
+				continue;
+			}
+			if (start < pos)
+				write_run();
+			start = pos + sector_size;
+		}
+	}
+	if (start < pos)
+		write_run();
+	if (result < 0) {
+		// We don't know what made it to the file, so make sure every
+		// sector is written next time.
+		int err = errno;
+		for (std::size_t j = 0; j < n; j++) {
+			std::uint64_t *h = frames.sector_hashes(page_frame(static_cast<PPage>(iov[j].iov_base)));
+			for (std::size_t s = 0; s < frames.frame_sectors; s++)
+				h[s] = ~h[s];
+		}
+		errno = err;
+	}
+	return result;
+}
+
+std::size_t
+MCryptFile::flush_threads()
+{
+	return std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1,
+								   max_flush_threads);
+}
+
+std::shared_future<void>
+MCryptFile::flush_async(std::size_t offset, std::size_t len)
+{
+	std::shared_future<void> done = std::async(std::launch::async, [this, offset, len] {
+		flush_range(offset, len);
+	}).share();
+	std::lock_guard<std::mutex> lk(flushes_lock);
+	// Forget the ones that have finished.
+	flushes.erase(std::remove_if(flushes.begin(), flushes.end(),
+								 [](const std::shared_future<void> &f) {
+		return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}), flushes.end());
+	flushes.push_back(done);
+	return done;
+}
+
+namespace {
+
+// Open a pressure stall information trigger that reports POLLPRI
+// whenever memory is short enough to stall tasks.
+unique_fd
+open_pressure_trigger()
+{
+	std::string path = "/proc/pressure/memory";
+	// Prefer the pressure file of our own (version 2) cgroup.
+	if (FILE *fp = fopen("/proc/self/cgroup", "r")) {
+		char line[4096];
+		while (fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, "0::", 3) != 0) continue;
+			line[strcspn(line, "\n")] = '\0';
+			std::string cg = std::string("/sys/fs/cgroup") + (line + 3) + "/memory.pressure";
+			if (access(cg.c_str(), W_OK) == 0)
+				path = cg;
+		}
+		fclose(fp);
+	}
+	unique_fd fd(open(path.c_str(), O_RDWR|O_NONBLOCK|O_CLOEXEC));
+	if (fd == -1)
+		threrror(path.c_str());
+	// Some task stalled for 100ms of a 2s window (the shortest window
+	// unprivileged processes may ask for).
+	static const char trigger[] = "some 100000 2000000";
+	if (write(fd, trigger, sizeof(trigger)) == -1)
+		threrror(path.c_str());
+	return fd;
+}
+
+// A thread that calls shrink each time a PSI trigger fires, and relax
+// after every relax_ms without one.
+class PressureMonitor {
+public:
+	static constexpr int relax_ms = 10'000;
+
+	PressureMonitor(unique_fd psi, std::function<void()> shrink,
+					std::function<void()> relax)
+		: psi_(std::move(psi)), stop_(eventfd(0, EFD_CLOEXEC)),
+		  shrink_(std::move(shrink)), relax_(std::move(relax)) {
+		if (stop_ == -1)
+			threrror("eventfd");
+		thread_ = std::thread(&PressureMonitor::run, this);
+	}
+	~PressureMonitor() {
+		std::uint64_t one = 1;
+		if (write(stop_, &one, sizeof(one)) == sizeof(one))
+			thread_.join();
+		else
+			thread_.detach();
+	}
+
+private:
+	unique_fd psi_;
+	unique_fd stop_;
+	std::function<void()> shrink_;
+	std::function<void()> relax_;
+	std::thread thread_;
+
+	void run() {
+		for (;;) {
+			pollfd fds[2] = {{psi_, POLLPRI, 0}, {stop_, POLLIN, 0}};
+			int n = poll(fds, 2, relax_ms);
+			if (n == -1 && errno == EINTR)
+				continue;
+			// Give up if the trigger breaks (e.g., our cgroup is removed).
+			if (n == -1 || fds[1].revents || fds[0].revents & POLLERR)
+				return;
+			// There is no one to report a failure to but the user.
+			try {
+				if (fds[0].revents & POLLPRI)
+					shrink_();
+				else
+					relax_();
+			} catch (const std::exception &e) {
+				std::fprintf(stderr, "MCryptFile: memory pressure: %s\n", e.what());
+			}
+		}
+	}
+};
+
+} // anonymous namespace
+
+void
+MCryptFile::watch_pressure()
+{
+	// Created after the pool, so destroyed (stopping its thread)
+	// before the pool is.
+	static PressureMonitor monitor(std::move(pressure_fd), [] {
+		std::lock_guard<std::mutex> lk(resize_lock);
+		std::size_t npages = pm->limit();
+		resize_pool(std::max(pressure_min_npages, npages - npages / 8));
+	}, [] {
+		std::lock_guard<std::mutex> lk(resize_lock);
+		// Only as far as the size the caller chose, not the maximum.
+		std::size_t npages = pm->limit();
+		std::size_t target = std::min(phys_npages, pm->npages());
+		if (npages < target)
+			resize_pool(std::min(target, npages + std::max(npages / 8, cluster_pages)));
+	});
+}
+
+void
+MCryptFile::follow_memory_pressure(std::size_t min_npages)
+{
+	std::lock_guard<std::mutex> lk(resize_lock);
+	if (pressure_min_npages)
+		return;
+	pressure_fd = open_pressure_trigger();
+	pressure_min_npages = std::max<std::size_t>(1, min_npages);
+	if (pm)
+		watch_pressure();
 }
 
 void
 MCryptFile::set_memory_size(std::size_t npages)
 {
-    phys_npages = npages;
+	std::lock_guard<std::mutex> lk(resize_lock);
+	phys_npages = npages;
+	if (pm)
+		resize_pool(npages);
+}
+
+void
+MCryptFile::set_max_memory_size(std::size_t npages)
+{
+	if (!pm) max_phys_npages = npages;
+}
+
+void
+MCryptFile::resize_pool(std::size_t npages)
+{
+	std::size_t limit = std::clamp<std::size_t>((npages + cluster_pages - 1) / cluster_pages,
+												1, nframes) * cluster_pages;
+	pm->set_limit(limit);
+	// Frames above the limit go back to the system as they are freed,
+	// so evict them all.  One that is being filled isn't on the clock
+	// yet, so keep going until it is.
+	Frame first = Frame(pm->limit() / cluster_pages);
+	while (pm->draining()) {
+		for (Frame f = first; f < nframes; f++) {
+			ClockShard &s = shard_of(f);
+			std::unique_lock<std::mutex> sl(s.lock);
+			if (!frames.on_clock[f]) continue;
+			std::unique_lock<std::mutex> lk(frames.owner[f]->pt_lock);
+			if (frames.state[f] & FrameTable::BUSY) continue;
+			if (!evict(f, sl, lk))
+				threrror("MCryptFile: write back");
+		}
+		if (pm->draining())
+			std::this_thread::yield();
+	}
+}
+
+void
+MCryptFile::set_cluster_size(std::size_t nbytes)
+{
+	std::size_t npages = nbytes / get_page_size();
+	if (npages == 0 || npages * get_page_size() != nbytes
+		|| (npages & (npages - 1)) || npages > max_cluster_pages)
+		throw std::invalid_argument("MCryptFile: bad cluster size");
+	if (!pm) cluster_pages = npages;
+}
+
+void
+MCryptFile::set_pool_options(const PoolOptions &opts)
+{
+	if (!pm) pool_options = opts;
+}
+
+void
+MCryptFile::set_map_reserve(std::size_t nbytes)
+{
+	map_reserve = nbytes;
+}
+
+void
+MCryptFile::set_sector_writeback(bool on)
+{
+	if (!pm) sector_writeback = on;
+}
+
+void
+MCryptFile::set_shared_cache(std::size_t nclusters)
+{
+	if (pm) return;
+	// Created now rather than with the pool, so that children forked
+	// before their first map() share it.
+	shared_cache.reset(nclusters ? new SharedCache(nclusters, cluster_bytes()) : nullptr);
+}
+
+void
+MCryptFile::set_tracking(Tracking t)
+{
+	if (!pm) tracking = t;
+}
+
+void
+MCryptFile::set_fault_delivery(FaultDelivery d)
+{
+	delivery = d;
 }
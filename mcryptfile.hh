@@ -1,46 +1,194 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <future>
+#include <mutex>
 #include <optional>
+#include <vector>
+
+#include <map>
+
+#include <sys/stat.h>
 
 #include "cryptfile.hh"
+#include "sharedcache.hh"
+
+struct MCryptFile;
+struct PagedVRegion;
+
+// Index of a cluster of pages in MCryptFile's PhysMem pool.  Page
+// tables and the frame table use these 32-bit frame numbers rather
+// than pointers to keep per-cluster metadata small.
+using Frame = std::uint32_t;
+constexpr Frame no_frame = ~Frame(0);		// Cluster is not resident
+constexpr Frame filling_frame = ~Frame(1);	// Cluster is being faulted in
+constexpr Frame zero_frame = ~Frame(2);		// Cluster is mapped to MCryptFile::zero_page
+
+// Per-frame paging metadata for the whole pool, kept as parallel
+// arrays indexed by Frame.  This replaces a heap-allocated PTE per
+// resident page, and lets the clock sweep it linearly.  Every page of
+// a cluster shares its frame's state.
+struct FrameTable {
+	// Bits of state[].  The low bits hold the Prot with which the
+	// frame is currently mapped at its VPages.
+	static constexpr std::uint8_t PROT_MASK = PROT_READ | PROT_WRITE;
+	static constexpr std::uint8_t MAPPED = 0x04;	// Mapped at its VPage
+	static constexpr std::uint8_t ACCESSED = 0x08;
+	static constexpr std::uint8_t DIRTY = 0x10;
+	// Set while some thread is filling, writing back, or evicting the
+	// page without holding pt_lock.  Other threads must wait on pt_cv
+	// until it is cleared before touching the page.
+	static constexpr std::uint8_t BUSY = 0x20;
+	static_assert((PROT_MASK & (MAPPED|ACCESSED|DIRTY|BUSY)) == 0);
 
+	std::unique_ptr<std::uint8_t[]> state;		// Protected by owner's pt_lock
+	std::unique_ptr<bool[]> on_clock;			// Protected by the frame's shard lock
+	std::unique_ptr<PagedVRegion *[]> owner;	// Region the page belongs to
+	std::unique_ptr<std::uint32_t[]> vpn;		// Cluster index within owner
+	// With sector write back, a hash of each sector of the frame as it
+	// was last read from or written to the file, frame_sectors per
+	// frame.  Only touched by the thread that has the frame busy.
+	std::unique_ptr<std::uint64_t[]> sector_hash;
+	std::size_t frame_sectors = 0;
 
+	// Allocate metadata for nframes frames of nsectors sectors each,
+	// or with no sector hashes if nsectors is 0.
+	void init(std::size_t nframes, std::size_t nsectors);
+	std::uint64_t *sector_hashes(Frame f) { return &sector_hash[f * frame_sectors]; }
+};
+
+// The pages of a file that are in memory, and the regions (if any) in
+// which they are mapped.  Pages are indexed by their cluster number
+// within the file, not by address, so they outlive the mappings: when
+// the file is unmapped, its clean pages stay cached (and on the clock)
+// until reclaim needs them, and mapping the file again picks them up.
+// Every handle that maps the same file shares one PagedVRegion (see
+// MCryptFile::caches), so each page is in memory only once, mapped
+// into each handle's own region.
 // Mostly based on the provided TraceRegion and AuxPTE in section
 // Credit: David Mazieres
 struct PagedVRegion {
-	struct PTE {
-		VPage vp;
-		PPage pp;
-		Prot prot;
-		bool accessed = false;
-		bool dirty = false;
-		itree_entry tree_link;
-		ilist_entry list_link;
-		
-		// Starting address of 1st VPage in VMRegion vp belongs to. Used for offset calculations.
-		VPage vr;
-
-		PTE(VPage vp0, Prot p, VPage vr);
-		~PTE();
-		void protect(Prot p);
-		void clear_accessed() { accessed = false; protect(PROT_NONE); }
+	// Page table indexed directly by cluster number within the region,
+	// so lookups are constant time.  It has two levels: the top level
+	// is allocated up front, while each leaf of leaf_size entries is
+	// only allocated once one of its pages is faulted in, which keeps
+	// sparsely used mappings of huge regions cheap.
+	//
+	// The page table also holds the region's dirty set, a bitmap of the
+	// clusters that have been modified since they were last written
+	// back (or are being written back), with a second bitmap of the
+	// leaves that have any, so that flushes can find the dirty clusters
+	// in order of file offset without looking at clean ones.
+	class PageTable {
+	public:
+		static constexpr std::size_t leaf_bits = 10;
+		static constexpr std::size_t leaf_size = std::size_t(1) << leaf_bits;
+
+		explicit PageTable(std::size_t npages);
+
+		std::size_t size() const { return npages_; }
+		// Frame holding cluster i, no_frame if it is not resident, or
+		// filling_frame if some thread is faulting it in.
+		Frame get(std::size_t i) const {
+			assert(i < npages_);
+			const Leaf *leaf = leaves_[i >> leaf_bits].get();
+			return leaf ? leaf->frames[i & (leaf_size - 1)] : no_frame;
+		}
+		// Set the entry for cluster i, allocating its leaf if necessary,
+		// and take cluster i out of the dirty set.
+		void set(std::size_t i, Frame f);
+		// Index of the first cluster at or after i whose entry is not
+		// no_frame, or size() if there is none.
+		std::size_t next(std::size_t i) const;
+
+		// Whether cluster i is in the dirty set.
+		bool dirty(std::size_t i) const {
+			assert(i < npages_);
+			const Leaf *leaf = leaves_[i >> leaf_bits].get();
+			return leaf && leaf->dirty[(i & (leaf_size - 1)) / 64] >> (i % 64) & 1;
+		}
+		// Add cluster i, which must be resident, to the dirty set, or
+		// remove it.
+		void set_dirty(std::size_t i, bool d);
+		// Index of the first cluster at or after i in the dirty set, or
+		// size() if there is none.
+		std::size_t next_dirty(std::size_t i) const;
+
+	private:
+		struct Leaf {
+			Frame frames[leaf_size];
+			std::uint64_t dirty[leaf_size / 64];	// One bit per entry
+		};
+		const std::size_t npages_;
+		std::vector<std::unique_ptr<Leaf>> leaves_;
+		std::vector<std::uint64_t> dirty_leaves_;	// One bit per leaf
 	};
 	
-    VMRegion vmem;
-	itree<&PTE::vp, &PTE::tree_link> pt;
+	// One handle's mapping of the file.  Its virtual memory is a whole
+	// number of clusters, aligned to the cluster size, and reserved up
+	// front for the largest size the file may grow to.  A page is
+	// mapped the same way (as recorded in FrameTable::state) in every
+	// handle's region.
+	struct Mapping {
+		MCryptFile *file;
+		std::unique_ptr<VMRegion> vmem;
+	};
+	std::vector<Mapping> mappings;	// Protected by pt_lock
+	// Only the first nbytes of each region are in use.  Only changes
+	// with pt_lock held.
+	std::atomic<std::size_t> nbytes;
+	std::mutex pt_lock;			// Protects pt and the state of every frame in it
+	std::condition_variable pt_cv;	// Signalled whenever a page stops being busy
+	PageTable pt;
+
+	// What the cached pages were read from: the file's key and
+	// identity, and its size and modification time as of detach(),
+	// to tell whether they can still be used when it is mapped again.
+	// Only used by regions listed in MCryptFile::caches.
+	Key key;
+	dev_t dev = 0;
+	ino_t ino = 0;
+	off_t file_size = 0;
+	timespec mtime{};
+	bool cached = false;		// Listed in MCryptFile::caches
+	int users = 0;				// Handles using it; protected by MCryptFile::caches_lock
+	// The file's first dense_bytes hold no holes (as of when it was
+	// mapped, less any truncation since), so faults there needn't
+	// look for one.
+	std::atomic<std::size_t> dense_bytes{0};
 
-    PagedVRegion(std::size_t nbytes, std::function<void(char *)> hdlr)
-     : vmem(nbytes, hdlr), pt() {}
+	// Creates a region with room for up to max_nbytes, not yet mapped
+	// anywhere.
+	PagedVRegion(std::size_t max_nbytes, std::size_t cluster_bytes)
+	  : nbytes(0), pt((max_nbytes + cluster_bytes - 1) / cluster_bytes) {}
     ~PagedVRegion();
 
-	char *get_base() { return vmem.get_base(); }
-	std::size_t size() { return vmem.nbytes_; }
+	// Reserve virtual memory in which to map the file for handle f,
+	// with faults handled by f->VMhandler, and return it.  At least
+	// the first nbytes are in use.
+	VMRegion *attach(MCryptFile *f, std::size_t nbytes, FaultDelivery delivery);
+	// Unmap every page from every region, leaving them all cached.
+	// Pages fault back in without I/O.
+	void unmap_all();
+	// Unmap every page, and release handle f's virtual memory.
+	void detach(MCryptFile *f);
+	// Whether any page is cached.
+	bool empty() {
+		std::lock_guard<std::mutex> lk(pt_lock);
+		return pt.next(0) == pt.size();
+	}
+	// Drop every cluster from cluster first on, without writing any
+	// of them back.  Takes pt_lock (and shard locks) itself.
+	void discard(std::size_t first);
 
-    char &operator[](std::ptrdiff_t i) {
-        assert(i >= 0 && std::size_t(i) < vmem.nbytes_);
-		return vmem.get_base()[i];
-    }
+	// FaultFn passing faults to MCryptFile *f
+	static void fault(void *f, char *va, bool write);
+
+	std::size_t size() { return nbytes; }
+
+private:
+	void unmap_all(std::unique_lock<std::mutex> &lk);
 };
 
 
@@ -49,6 +197,13 @@ struct PagedVRegion {
 // you can also memory-map the file--just like the mmap system call,
 // except that pages are decrypted on the way in and encrypted when
 // written back out.
+//
+// Any number of threads may fault on mapped regions concurrently.
+// Each region's page table is protected by its own pt_lock.  The pool
+// is split into clock shards of contiguous frames, each with its own
+// lock and hand, so that threads on different CPUs can reclaim in
+// parallel.  When both are needed, a shard lock must be acquired
+// before any pt_lock.
 struct MCryptFile : public CryptFile {
     // Opens file path using encryption key key.  Throws a
     // std::system_error if the file cannot be opened.
@@ -60,10 +215,22 @@ struct MCryptFile : public CryptFile {
     // want to grow the file, you can supply a min_size > 0, and the
     // mapped region will be the larger of min_size and the file's actual
     // size.  If you want to grow a file after it has already been mapped,
-    // unmap() and then re-map() it, which will likely move map_base() and
-    // invalidate any old pointers into the previous mapped region.
+    // use resize().  If another handle has the file mapped, the two
+    // share its pages; throws std::invalid_argument if their keys
+    // differ, and std::length_error if the other reserved too little
+    // address space for this mapping (see set_map_reserve).
     char *map(std::size_t min_size = 0);
 
+    // Change the size of the mapped region to new_size, in place:
+    // map_base() stays put, and pointers into the region, along with
+    // pages already in memory, remain valid.  The file grows as pages
+    // past its end are written back (just as with map(min_size));
+    // when the region shrinks, the file is truncated and pages past
+    // the new end are dropped.  Throws std::length_error if new_size
+    // exceeds the address space reserved when the file was mapped
+    // (see set_map_reserve).
+    void resize(std::size_t new_size);
+
     // Remove the mapping created by map, invalidating all pointers.
     void unmap();
 
@@ -72,7 +239,7 @@ struct MCryptFile : public CryptFile {
     // unmap().
     char *map_base() {
         if (pvreg == nullptr) throw std::runtime_error("MCryptFile is not currently mapped.");
-        return pvreg->get_base();
+        return region->get_base();
     }
 
     // Size of mapped file (once map() has been called)
@@ -82,24 +249,303 @@ struct MCryptFile : public CryptFile {
     }
 
     // Flush all changes back to the encrypted file; pages currently
-    // in memory remain there.
+    // in memory remain there.  Only the region's dirty set is visited,
+    // so this takes time in proportion to the number of modified
+    // pages, not the number of resident ones.  Adjacent dirty pages
+    // are written together, and several such runs are encrypted and
+    // written in parallel (by up to max_flush_threads threads).
+    // Throws std::system_error if a write fails; the pages it
+    // covered remain dirty.
     void flush();
+    static constexpr std::size_t max_flush_threads = 8;
+    // Like flush, but only for changes to the len bytes of the
+    // mapping starting at offset.
+    void flush_range(std::size_t offset, std::size_t len);
+    // Like flush_range, but in another thread.  The returned future
+    // becomes ready when the flush is done (and get() rethrows any
+    // error it hit).  unmap() waits for all asynchronous flushes.
+    std::shared_future<void> flush_async(std::size_t offset = 0,
+                                         std::size_t len = SIZE_MAX);
     
     // Specifies size of the physical memory pool shared by all
-    // MCryptFile objects. Must be invoked before any MCryptFile
-    // objects have been created; later indications will have no effect.
+    // MCryptFile objects.  Once files have been mapped, the pool can
+    // still grow up to its maximum size (see set_max_memory_size) or
+    // shrink, in which case pages are evicted until it fits.
     static void set_memory_size(std::size_t npages);
+    // Specifies the largest size that set_memory_size can later grow
+    // the pool to (by default, the size it starts with).  Memory is
+    // only used for the current size, so this can be generous.  Must
+    // be invoked before any file is mapped; later indications will
+    // have no effect.
+    static void set_max_memory_size(std::size_t npages);
+    // Shrink the pool by an eighth (but not below min_npages) whenever
+    // the cgroup we run in (or, failing that, the whole system) sees
+    // memory pressure, and grow it back towards the size last set
+    // with set_memory_size while there is none.  Throws
+    // std::system_error if the kernel does not report pressure stall
+    // information.
+    static void follow_memory_pressure(std::size_t min_npages);
+
+	// How the clock learns which pages have been used.
+	enum class Tracking {
+		// Revoke access to pages and catch the resulting page faults.
+		MPROTECT,
+		// Leave pages mapped read/write and have the kernel record
+		// accesses (see VMRegion::track), so that the hot set runs
+		// without page faults.  Falls back to MPROTECT if the kernel
+		// cannot do this.
+		PAGEMAP,
+	};
+	// Selects how page use is tracked.  Like set_max_memory_size,
+	// this has no effect once any file has been mapped.
+	static void set_tracking(Tracking t);
+	// The tracking actually in use, which is MPROTECT if PAGEMAP was
+	// selected but the kernel can't do it.  Only final once any file
+	// has been mapped.
+	static Tracking effective_tracking() { return tracking; }
+
+	// Selects how page faults are delivered (see FaultDelivery) for
+	// regions created by later calls to map().
+	static void set_fault_delivery(FaultDelivery d);
+	// How page faults are delivered for the current mapping, which is
+	// SIGNAL if USERFAULTFD was selected but isn't available.
+	FaultDelivery effective_delivery() {
+		if (region == nullptr) throw std::runtime_error("MCryptFile is not currently mapped.");
+		return region->delivery_;
+	}
+
+	// Sets the unit in which pages are faulted in, evicted and
+	// written back, which must be page_size times a power of two no
+	// greater than max_cluster_pages.  Each cluster occupies
+	// physically contiguous pages of the pool (huge pages, where the
+	// kernel can provide them), so large clusters cut the number of
+	// faults for big sequential working sets.  Like
+	// set_max_memory_size, this has no effect once any file has been
+	// mapped.
+	static void set_cluster_size(std::size_t nbytes);
+	static constexpr std::size_t max_cluster_pages = 512;
+
+	// Selects how the memory pool is backed and pinned (see
+	// PoolOptions); for instance, opts.prefault has a background
+	// thread fault in the whole pool as soon as it is created, so that
+	// later page faults don't have to.  Huge pages are only used if
+	// the cluster size is a multiple of PhysMem::huge_page_size().
+	// Like set_max_memory_size, this has no effect once any file has
+	// been mapped.
+	static void set_pool_options(const PoolOptions &opts);
+
+	// Sets the minimum size of the address space that map() reserves
+	// for each region, which bounds how far resize() can grow it.
+	// Reserving address space is cheap, so the default, 1 GiB, is
+	// generous.  Affects regions created by later calls to map().
+	static void set_map_reserve(std::size_t nbytes);
+
+	// With sector write back on, a hash of every sector_size bytes of
+	// a cluster is recorded when it is read in, and write back only
+	// encrypts and writes the sectors whose contents have changed
+	// since, rather than whole pages.  (The hash is a fast one, not a
+	// cryptographic one.)  Like set_max_memory_size, this has no
+	// effect once any file has been mapped.
+	static void set_sector_writeback(bool on);
+	static constexpr std::size_t sector_size = 512;
+
+	// Create a SharedCache with room for nclusters clusters, and share
+	// decrypted clusters through it with the child processes forked
+	// from now on.  A fault on a cluster that any of them has read or
+	// written back since is then served from there, without reading
+	// or decrypting anything.  The cache is locked memory on top of
+	// each process's pool, and lasts until the last of them exits.
+	// The pools themselves stay private: a frame one process evicts
+	// can't be unmapped from the others' page tables.  To save memory
+	// too, give each process a small pool (see set_memory_size) and
+	// the cache room for the shared working set, so that clusters
+	// evicted from a pool come back with a copy rather than a read
+	// and a decryption.
+	// Call it after set_cluster_size; the processes must change the
+	// files they map only through MCryptFile.  Zero clusters drops
+	// the cache.  Like set_max_memory_size, this has no effect once
+	// any file has been mapped.
+	static void set_shared_cache(std::size_t nclusters);
+
+	// Number of page faults taken on this file's mappings (for tests).
+	std::atomic<int> faults;
 	
 	friend PagedVRegion;
 private:
 	static PhysMem *pm;	  // Pointer to a PhysMem object created statically on the first use of map
-	static std::size_t phys_npages;
+	static std::size_t phys_npages;		// Size set_memory_size asked for
+	static std::size_t max_phys_npages;
+	static std::size_t nframes;			// Number of clusters *pm can hold
+	static std::size_t pressure_min_npages;
+	static unique_fd pressure_fd;		// PSI trigger, until watch_pressure takes it
+	static std::mutex resize_lock;		// Serializes changes to the pool size
+	static std::size_t cluster_pages;	// Pages per cluster
+	static PoolOptions pool_options;
+	// Regions of files that are mapped, or were and still have pages
+	// cached, by device and inode number.  Handles mapping the same
+	// file share its region.
+	static std::map<std::pair<dev_t, ino_t>, PagedVRegion *> caches;
+	static std::mutex caches_lock;	// Protects caches; taken before shard locks
+	static bool sector_writeback;
+	static std::size_t map_reserve;
+	static std::unique_ptr<SharedCache> shared_cache;	// If set_shared_cache was called
 	static int instances;
-	static ilist<&PagedVRegion::PTE::list_link> currentPTEs;	// Circularly linked list of pages for clock algorithm
-	static PagedVRegion::PTE *clock_curr;	// Current page the clock hand is pointing to
+	static FrameTable frames;	// Metadata for every frame in *pm
+	static PPage zero_page;		// A cluster of zeros, only ever mapped read-only
+	// Every region shares zero_page, so its PhysMem refcounts need a
+	// lock of their own; taken after pt_lock.
+	static std::mutex zero_lock;
+	static Tracking tracking;
+	static FaultDelivery delivery;
+
+	// One contiguous range of frames, with its own clock hand.
+	// Reclaim starts from the shard of the CPU it runs on.
+	struct alignas(64) ClockShard {
+		std::mutex lock;	// Protects hand and frames.on_clock[] of our frames
+		Frame begin, end;	// Frames belonging to this shard
+		Frame hand;			// Next frame the clock hand will look at
+	};
+	// Never split the pool into shards smaller than this, so that
+	// each clock still has enough frames to approximate LRU.
+	static constexpr std::size_t min_shard_frames = 64;
+	static std::unique_ptr<ClockShard[]> shards;
+	static std::size_t nshards;
+	static std::size_t shard_frames;	// Frames per shard (the last may have fewer)
 	
     PagedVRegion *pvreg;
-	void VMhandler(char *va);
-};
+	VMRegion *region;			// Our mapping of pvreg
+	std::mutex flushes_lock;
+	std::vector<std::shared_future<void>> flushes;	// From flush_async
+	void VMhandler(char *va, bool write);
 
+	// Delete the detached regions in caches that no longer hold any
+	// pages.  Caller must hold caches_lock.
+	static void prune_caches();
+	// Create the PhysMem pool, frame table and clock shards on first use.
+	static void init_pool();
+	// Index of the shard belonging to the CPU we are running on.
+	static unsigned cpu_shard();
+	static ClockShard &shard_of(Frame f) { return shards[f / shard_frames]; }
 
+	static std::size_t cluster_bytes() { return cluster_pages * get_page_size(); }
+	static PPage frame_page(Frame f) { return pm->pool_base() + std::size_t(f) * cluster_bytes(); }
+	static Frame page_frame(PPage pp) { return Frame((pp - pm->pool_base()) / cluster_bytes()); }
+	static std::size_t frame_offset(Frame f) { return std::size_t(frames.vpn[f]) * cluster_bytes(); }
+	// Bytes of file data in the n clusters of pvr starting at cluster
+	// first: whole clusters, except that the last cluster of the
+	// region ends with its last page.
+	static std::size_t io_bytes(PagedVRegion *pvr, std::size_t first, std::size_t n);
+
+	// Map frame f at its VPages with protection p, without changing
+	// its accessed and dirty bits.  Caller must hold its owner's pt_lock.
+	static void set_prot(Frame f, Prot p);
+	// Like set_prot, but also records an access (if p allows reads)
+	// or a modification (if p allows writes, unless the kernel is
+	// tracking modifications for us).
+	static void protect(Frame f, Prot p);
+	// Set the dirty bit of frame f and add it to its owner's dirty
+	// set.  Caller must hold its owner's pt_lock.
+	static void mark_dirty(Frame f) {
+		frames.state[f] |= FrameTable::DIRTY;
+		frames.owner[f]->pt.set_dirty(frames.vpn[f], true);
+	}
+	// With PAGEMAP tracking, fold the accesses the kernel has
+	// recorded for f into its accessed and dirty bits, and reset them
+	// (the kernel's accessed indication only if reset_accessed, which
+	// also leaves f read-only if it was accessed).  Does nothing with
+	// MPROTECT tracking.
+	static void harvest(Frame f, bool reset_accessed);
+	// Clear the accessed bit of frame f, which must be on the clock,
+	// and revoke access to it unless the kernel is tracking accesses.
+	// Frames after f (but before limit) holding the next clusters of
+	// the same region may be cleared along with it; returns the first
+	// frame not cleared.  Caller must hold f's shard lock and its
+	// owner's pt_lock.
+	static Frame clear_accessed(Frame f, Frame limit);
+	// Unmap frame f from its VPages, if it is mapped.  Caller must hold
+	// its owner's pt_lock.
+	static void unmap_frame(Frame f);
+	// Unmap frame f and return it to the pool.  Caller must hold its
+	// owner's pt_lock, and f must already be off the clock.
+	static void release(Frame f);
+
+	// Longest run of pages handed to a single VMRegion range
+	// operation, and the corresponding number of clusters.
+	static constexpr std::size_t max_run_pages = max_cluster_pages;
+	static std::size_t max_run() { return max_run_pages / cluster_pages; }
+	// Call op(vmem, va, pis) for each region in which pvr is mapped,
+	// where va is the address of the n (at most max_run())
+	// consecutive resident clusters of pvr starting at cluster first,
+	// and pis the PageInfos of their pages, and then store the
+	// resulting PageInfos in the frame table.  Caller must hold pvr's
+	// pt_lock.
+	template <typename Op>
+	static void for_each_region(PagedVRegion *pvr, std::size_t first, std::size_t n, Op op);
+	// Map zero_page read-only at cluster i of every region of pvr, or
+	// unmap it again.  Caller must hold pvr's pt_lock.
+	static void map_zero(PagedVRegion *pvr, std::size_t i);
+	static void unmap_zero(PagedVRegion *pvr, std::size_t i);
+	// Map every page of pvr that is mapped in its other regions into
+	// vmem, a new one, the same way.  Caller must hold pvr's pt_lock.
+	static void map_view(PagedVRegion *pvr, VMRegion &vmem);
+	// Whether cluster i of the file holds no data, because it is past
+	// the end of the file or in a hole.  Such clusters read as zeros.
+	// Only asks the kernel past pvreg->dense_bytes.
+	bool is_hole(std::size_t i);
+	// Store the PageInfos of all pages of the n (at most max_run())
+	// consecutive resident clusters of pvr starting at cluster first
+	// in pis, and store them back in the frame table after a range
+	// operation has updated them.
+	static void get_page_infos(PagedVRegion *pvr, std::size_t first, std::size_t n,
+							   VMRegion::PageInfo *pis);
+	static void put_page_infos(PagedVRegion *pvr, std::size_t first, std::size_t n,
+							   const VMRegion::PageInfo *pis);
+	// Like set_prot, for the n (at most max_run()) consecutive
+	// clusters of pvr starting at cluster first, which must all be
+	// mapped.
+	static void set_prot_run(PagedVRegion *pvr, std::size_t first, std::size_t n, Prot p);
+	// Like release, for n (at most max_run()) consecutive resident
+	// clusters of pvr starting at cluster first.  Does not update pt.
+	static void release_run(PagedVRegion *pvr, std::size_t first, std::size_t n);
+
+	// Evict one cluster chosen by the clock algorithm of shard s.
+	// Returns false if none of the shard's frames can be evicted
+	// right now (they are all free or busy, or can't be written
+	// back, in which case *error is set to the errno).
+	static bool evict_one(ClockShard &s, int *error);
+	// Evict frame f, which must be on the clock and not busy, with
+	// its shard lock held in sl and its owner's pt_lock in lk.
+	// Releases sl.  Returns false (with errno set) if f is dirty and
+	// writing it back fails, in which case it stays, still dirty.
+	static bool evict(Frame f, std::unique_lock<std::mutex> &sl,
+					  std::unique_lock<std::mutex> &lk);
+	// Set the pool size with resize_lock held, evicting every frame
+	// above it when it shrinks.  Throws std::system_error if one of
+	// them can't be written back.
+	static void resize_pool(std::size_t npages);
+	// Start the thread that follows memory pressure, once.
+	static void watch_pressure();
+	// Record the hashes of the sectors of frame f, which has just
+	// been filled with nbytes of file data followed by zeroes.
+	// Sectors that aren't wholly in the file get a hash that won't
+	// match, so they are always written back.
+	static void hash_sectors(Frame f, std::size_t nbytes);
+	// Encrypt and write back the n (at most max_run()) consecutive
+	// clusters starting at cluster first, whose frames' data is
+	// described by iov, all of which must be busy.  With sector write
+	// back, only writes the sectors that have changed.  Also passes
+	// the new contents on to the shared cache, if any.  Returns -1
+	// (with errno set) if a write fails or is short.
+	int write_back(std::size_t first, const struct iovec *iov, std::size_t n);
+	// The sector write back part of write_back.
+	int write_sectors(std::size_t first, const struct iovec *iov, std::size_t n);
+	// Identifies cluster i of pvr's file in shared_cache.
+	static SharedCache::Tag shared_tag(PagedVRegion *pvr, std::size_t i) {
+		return {pvr->dev, pvr->ino, SharedCache::fingerprint(pvr->key.data(), pvr->key.size()), i};
+	}
+	// Number of threads a flush may use: one per CPU, up to
+	// max_flush_threads.
+	static std::size_t flush_threads();
+	// Allocate a cluster of PPages, evicting others as necessary.
+	static PPage alloc_frame();
+};
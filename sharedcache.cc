@@ -0,0 +1,274 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sharedcache.hh"
+#include "vm.hh"
+
+struct SharedCache::Header {
+    std::uint64_t cluster_bytes;
+    std::uint64_t nslots;
+    std::uint64_t nbuckets;             // A power of two
+    pthread_mutex_t mutex;              // Protects everything below
+    std::uint64_t generation;           // Bumped whenever file contents change
+    std::uint64_t hand;                 // Next slot the clock looks at
+};
+
+struct SharedCache::Slot {
+    Tag tag;
+    std::int32_t next;                  // Next slot in the same hash chain
+    std::uint32_t len;                  // Bytes of the cluster in the file
+    bool valid;
+    bool referenced;                    // Used since the clock last passed
+};
+
+namespace {
+
+constexpr std::size_t
+round_up(std::size_t n, std::size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+bool
+operator==(const SharedCache::Tag &a, const SharedCache::Tag &b)
+{
+    return a.dev == b.dev && a.ino == b.ino && a.key == b.key
+        && a.cluster == b.cluster;
+}
+
+} // anonymous namespace
+
+SharedCache::SharedCache(std::size_t nslots, std::size_t cluster_bytes)
+    : base_(nullptr)
+{
+    // The header, then the hash chains, then the slots, and then
+    // (page aligned) their data.
+    std::size_t nbuckets = 1;
+    while (nbuckets < 2 * nslots)
+        nbuckets *= 2;
+    std::size_t buckets_off = round_up(sizeof(Header), alignof(Slot));
+    std::size_t slots_off = round_up(buckets_off + nbuckets * sizeof(std::int32_t),
+                                     alignof(Slot));
+    std::size_t data_off = round_up(slots_off + nslots * sizeof(Slot), get_page_size());
+    size_ = data_off + nslots * cluster_bytes;
+
+    // Children inherit the mapping, not the file, which is closed
+    // (and, once every mapping is gone, freed) here.
+    unique_fd fd(memfd_create("SharedCache", MFD_CLOEXEC));
+    if (fd == -1)
+        threrror("memfd_create");
+    if (ftruncate(fd, size_) == -1)
+        threrror("ftruncate");
+    void *p = mmap(nullptr, size_, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        threrror("mmap");
+    base_ = static_cast<char *>(p);
+    // Unlike the pool's, these pages are locked unconditionally: a
+    // cache in swap would be no faster than the file, and would leak
+    // its plaintext there.
+    if (mlock(base_, size_) == -1) {
+        int err = errno;
+        munmap(base_, size_);
+        errno = err;
+        threrror("SharedCache mlock");
+    }
+    madvise(base_, size_, MADV_DONTDUMP);
+
+    hdr_ = reinterpret_cast<Header *>(base_);
+    hdr_->cluster_bytes = cluster_bytes;
+    hdr_->nslots = nslots;
+    hdr_->nbuckets = nbuckets;
+    hdr_->generation = 0;
+    hdr_->hand = 0;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&hdr_->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    buckets_ = reinterpret_cast<std::int32_t *>(base_ + buckets_off);
+    slots_ = reinterpret_cast<Slot *>(base_ + slots_off);
+    data_ = base_ + data_off;
+    clear();
+}
+
+SharedCache::~SharedCache()
+{
+    if (base_)
+        munmap(base_, size_);
+}
+
+std::size_t
+SharedCache::cluster_bytes() const
+{
+    return hdr_->cluster_bytes;
+}
+
+std::uint64_t
+SharedCache::fingerprint(const void *key, std::size_t len)
+{
+    // FNV-1a
+    std::uint64_t h = 0xcbf29ce484222325;
+    for (std::size_t i = 0; i < len; i++) {
+        h ^= static_cast<const std::uint8_t *>(key)[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+void
+SharedCache::lock()
+{
+    int r = pthread_mutex_lock(&hdr_->mutex);
+    if (r == EOWNERDEAD) {
+        // Its last owner died in the middle of who knows what.
+        clear();
+        pthread_mutex_consistent(&hdr_->mutex);
+    } else if (r != 0) {
+        errno = r;
+        threrror("pthread_mutex_lock");
+    }
+}
+
+void
+SharedCache::unlock()
+{
+    pthread_mutex_unlock(&hdr_->mutex);
+}
+
+void
+SharedCache::clear()
+{
+    for (std::size_t i = 0; i < hdr_->nbuckets; i++)
+        buckets_[i] = nil;
+    for (std::size_t i = 0; i < hdr_->nslots; i++)
+        slots_[i].valid = false;
+    hdr_->generation++;
+}
+
+std::int32_t &
+SharedCache::bucket(const Tag &t)
+{
+    std::uint64_t h = t.key ^ (std::uint64_t(t.dev) * 0x9e3779b97f4a7c15)
+        ^ (std::uint64_t(t.ino) * 0xbf58476d1ce4e5b9) ^ (t.cluster * 0x94d049bb133111eb);
+    h ^= h >> 31;
+    return buckets_[h & (hdr_->nbuckets - 1)];
+}
+
+std::int32_t
+SharedCache::find(const Tag &t)
+{
+    std::int32_t s = bucket(t);
+    while (s != nil && !(slots_[s].tag == t))
+        s = slots_[s].next;
+    return s;
+}
+
+void
+SharedCache::remove(std::int32_t s)
+{
+    std::int32_t *link = &bucket(slots_[s].tag);
+    while (*link != s)
+        link = &slots_[*link].next;
+    *link = slots_[s].next;
+    slots_[s].valid = false;
+}
+
+void
+SharedCache::store(const Tag &t, const void *src, std::size_t len)
+{
+    std::int32_t s = find(t);
+    if (s == nil) {
+        // Take the first slot that is free or hasn't been used since
+        // the clock last came by.
+        for (;;) {
+            s = std::int32_t(hdr_->hand);
+            hdr_->hand = (hdr_->hand + 1) % hdr_->nslots;
+            Slot &v = slots_[s];
+            if (v.valid && v.referenced) {
+                v.referenced = false;
+                continue;
+            }
+            if (v.valid)
+                remove(s);
+            break;
+        }
+        std::int32_t &head = bucket(t);
+        slots_[s].tag = t;
+        slots_[s].next = head;
+        slots_[s].valid = true;
+        head = s;
+    }
+    Slot &slot = slots_[s];
+    len = std::min<std::size_t>(len, hdr_->cluster_bytes);
+    memcpy(data_ + std::size_t(s) * hdr_->cluster_bytes, src, len);
+    slot.len = std::uint32_t(len);
+    slot.referenced = true;
+}
+
+int
+SharedCache::lookup(const Tag &t, void *dst, std::uint64_t *gen)
+{
+    lock();
+    std::int32_t s = find(t);
+    int n = -1;
+    if (s == nil) {
+        *gen = hdr_->generation;
+    } else {
+        Slot &slot = slots_[s];
+        memcpy(dst, data_ + std::size_t(s) * hdr_->cluster_bytes, slot.len);
+        slot.referenced = true;
+        n = int(slot.len);
+    }
+    unlock();
+    return n;
+}
+
+void
+SharedCache::fill(const Tag &t, const void *src, std::size_t len, std::uint64_t gen)
+{
+    lock();
+    // Writes bump the generation only once the cache has their data,
+    // so if it hasn't moved, the read saw the latest contents.
+    if (hdr_->generation == gen && find(t) == nil)
+        store(t, src, len);
+    unlock();
+}
+
+void
+SharedCache::update(const Tag &t, const void *src, std::size_t len)
+{
+    lock();
+    store(t, src, len);
+    hdr_->generation++;
+    unlock();
+}
+
+void
+SharedCache::invalidate(const Tag &t)
+{
+    lock();
+    std::int32_t s = find(t);
+    if (s != nil)
+        remove(s);
+    hdr_->generation++;
+    unlock();
+}
+
+void
+SharedCache::invalidate(dev_t dev, ino_t ino, std::uint64_t first)
+{
+    lock();
+    for (std::size_t s = 0; s < hdr_->nslots; s++) {
+        const Tag &t = slots_[s].tag;
+        if (slots_[s].valid && t.dev == dev && t.ino == ino && t.cluster >= first)
+            remove(std::int32_t(s));
+    }
+    hdr_->generation++;
+    unlock();
+}
@@ -0,0 +1,87 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// A cache of decrypted file clusters in anonymous shared memory (a
+// memfd), which the process that creates it shares with the children
+// it forks afterwards, so that a cluster read and decrypted by one of
+// them need not be read or decrypted again by the others.  Slots are
+// replaced by a single clock shared by all processes, and everything
+// is protected by one robust, process-shared mutex, so a process that
+// dies holding it costs only the cache's contents.
+//
+// The cache has no name, so no unrelated process can open it, and it
+// goes away when the last process using it destroys it or exits.  It
+// is memory on top of each process's own pool, not instead of it (a
+// cluster in use is in both): it saves reads and decryption, not
+// memory.  Since it holds plaintext, it is locked in memory, so that it
+// is never written to swap, and left out of core dumps.
+//
+// Clusters are identified by device, inode, a fingerprint of the key
+// and cluster number.  The cache stays coherent with the file only as
+// long as all changes to it go through update (or invalidate).
+class SharedCache {
+public:
+    // Identifies one cluster of one file as decrypted with one key.
+    struct Tag {
+        dev_t dev;
+        ino_t ino;
+        std::uint64_t key;
+        std::uint64_t cluster;
+    };
+
+    // Create a cache with room for nslots clusters of cluster_bytes.
+    // Throws std::system_error if its memory can't be locked (see
+    // mlock and RLIMIT_MEMLOCK).
+    SharedCache(std::size_t nslots, std::size_t cluster_bytes);
+    ~SharedCache();
+    SharedCache(const SharedCache &) = delete;
+    SharedCache &operator=(const SharedCache &) = delete;
+
+    // Copy the cluster identified by t to dst, which has room for a
+    // whole cluster, and return its length.  Returns -1 if it is not
+    // cached, with *gen set to pass to a later fill.
+    int lookup(const Tag &t, void *dst, std::uint64_t *gen);
+    // Cache len bytes read from the file after a lookup that returned
+    // gen, unless the cluster is already cached or a write to any file
+    // may have overtaken the read.
+    void fill(const Tag &t, const void *src, std::size_t len, std::uint64_t gen);
+    // Record that the cluster's contents in the file are now the len
+    // bytes at src.
+    void update(const Tag &t, const void *src, std::size_t len);
+    // Drop the cluster, whose contents in the file are unknown.
+    void invalidate(const Tag &t);
+    // Drop every cluster of the file from cluster first on.
+    void invalidate(dev_t dev, ino_t ino, std::uint64_t first = 0);
+
+    // Size of the clusters it holds.
+    std::size_t cluster_bytes() const;
+
+    // Fingerprint of a key, for Tag::key.
+    static std::uint64_t fingerprint(const void *key, std::size_t len);
+
+private:
+    struct Header;
+    struct Slot;
+    static constexpr std::int32_t nil = -1;
+
+    char *base_;                // The whole shared mapping
+    std::size_t size_;
+    Header *hdr_;
+    std::int32_t *buckets_;     // Heads of the hash chains of slots
+    Slot *slots_;
+    char *data_;                // Each slot's cluster
+
+    void lock();
+    void unlock();
+    std::int32_t &bucket(const Tag &t);
+    std::int32_t find(const Tag &t);
+    void remove(std::int32_t s);
+    void store(const Tag &t, const void *src, std::size_t len);
+    void clear();
+};
@@ -0,0 +1,158 @@
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "slab.hh"
+
+namespace {
+
+std::atomic<unsigned> nslabs;
+
+} // anonymous namespace
+
+Slab::Slab(std::size_t objsize, std::size_t align)
+    : objsize_((std::max(objsize, sizeof(FreeBlock)) + align - 1) & ~(align - 1)),
+      align_(align), id_(nslabs++)
+{
+    assert(align && (align & (align - 1)) == 0);
+    if (id_ >= max_slabs)
+        throw std::length_error("Slab: too many slabs");
+}
+
+Slab::~Slab()
+{
+    for (void *chunk : chunks_)
+        ::operator delete(chunk, std::align_val_t(align_));
+}
+
+Slab::Cache &
+Slab::cache()
+{
+    static thread_local Cache caches[max_slabs];
+    Cache &c = caches[id_];
+    if (!c.slab_)
+        c.slab_ = this;
+    // If this assertion fails, a Slab was used after being destroyed.
+    assert(c.slab_ == this);
+    return c;
+}
+
+Slab::Cache::~Cache()
+{
+    // Give our blocks back, so they aren't lost when threads exit.
+    if (slab_) {
+        slab_->cache_hits_ += hits_;
+        slab_->drain(*this, n_);
+    }
+}
+
+void *
+Slab::alloc()
+{
+    Cache &c = cache();
+    allocs_.fetch_add(1, std::memory_order_relaxed);
+    if (c.head_) {
+        // Fold our hits into the shared counter now and then rather
+        // than bouncing its cache line between threads on every call.
+        if (++c.hits_ == cache_max) {
+            cache_hits_.fetch_add(c.hits_, std::memory_order_relaxed);
+            c.hits_ = 0;
+        }
+    }
+    else
+        refill(c, cache_max / 2);
+
+    FreeBlock *b = c.head_;
+    c.head_ = b->next_;
+    --c.n_;
+    return b;
+}
+
+void
+Slab::free(void *p)
+{
+    if (!p)
+        return;
+    Cache &c = cache();
+    FreeBlock *b = static_cast<FreeBlock *>(p);
+    b->next_ = c.head_;
+    c.head_ = b;
+    if (++c.n_ > cache_max)
+        drain(c, cache_max / 2);
+}
+
+void
+Slab::reserve(std::size_t n)
+{
+    std::lock_guard<std::mutex> lk(lock_);
+    if (nfree_ < n)
+        grow(n - nfree_);
+}
+
+Slab::Stats
+Slab::stats() const
+{
+    return { allocs_.load(), cache_hits_.load(),
+             refills_.load(), grows_.load() };
+}
+
+void
+Slab::grow(std::size_t nblocks)
+{
+    char *chunk = static_cast<char *>(
+        ::operator new(nblocks * objsize_, std::align_val_t(align_)));
+    chunks_.push_back(chunk);
+    for (std::size_t i = nblocks; i-- > 0;) {
+        FreeBlock *b = reinterpret_cast<FreeBlock *>(chunk + i * objsize_);
+        b->next_ = free_;
+        free_ = b;
+    }
+    nfree_ += nblocks;
+}
+
+void
+Slab::refill(Cache &c, std::size_t n)
+{
+    std::lock_guard<std::mutex> lk(lock_);
+    refills_.fetch_add(1, std::memory_order_relaxed);
+    if (!free_) {
+        grows_.fetch_add(1, std::memory_order_relaxed);
+        grow(std::max(n, chunk_blocks));
+    }
+    for (; n > 0 && free_; --n) {
+        FreeBlock *b = free_;
+        free_ = b->next_;
+        --nfree_;
+        b->next_ = c.head_;
+        c.head_ = b;
+        ++c.n_;
+    }
+}
+
+void
+Slab::drain(Cache &c, std::size_t n)
+{
+    std::lock_guard<std::mutex> lk(lock_);
+    for (; n > 0 && c.head_; --n) {
+        FreeBlock *b = c.head_;
+        c.head_ = b->next_;
+        --c.n_;
+        b->next_ = free_;
+        free_ = b;
+        ++nfree_;
+    }
+}
+
+Slab &
+page_slab()
+{
+    // Never destroyed, since threads may still return blocks to it
+    // while the program exits.
+    static Slab &slab = *new Slab(sysconf(_SC_PAGESIZE),
+                                  sysconf(_SC_PAGESIZE));
+    return slab;
+}
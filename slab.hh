@@ -0,0 +1,114 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// A pool of fixed-size blocks for hot paths (such as page faults)
+// where calling into the general-purpose allocator is too expensive.
+// Each thread keeps a small private cache of free blocks and only
+// takes the slab's lock to move a batch of blocks between its cache
+// and the shared free list.  The shared list is refilled by carving
+// chunk_blocks new blocks out of a single allocation, and memory is
+// only returned to the system when the Slab is destroyed, so once a
+// workload reaches steady state it never calls malloc.
+class Slab {
+public:
+    // Create a slab of objsize-byte blocks, aligned to align bytes
+    // (which must be a power of two).  Up to max_slabs Slab objects
+    // may exist over the life of the program.
+    Slab(std::size_t objsize, std::size_t align = alignof(std::max_align_t));
+    ~Slab();
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    std::size_t object_size() const { return objsize_; }
+
+    void *alloc();
+    void free(void *p);
+
+    // Make sure at least n blocks are available without calling the
+    // general-purpose allocator again.
+    void reserve(std::size_t n);
+
+    // Counters for measuring how well the caches work.  Cache hits
+    // are folded in from each thread every cache_max hits, so they
+    // may lag slightly behind allocs.
+    struct Stats {
+        std::uint64_t allocs;       // Total calls to alloc()
+        std::uint64_t cache_hits;   // Served from the thread's cache
+        std::uint64_t refills;      // Cache refilled from the shared list
+        std::uint64_t grows;        // New chunks from the system allocator
+    };
+    Stats stats() const;
+
+    static constexpr std::size_t max_slabs = 8;
+    static constexpr std::size_t cache_max = 32;    // Blocks per thread cache
+    static constexpr std::size_t chunk_blocks = 16; // Blocks per new chunk
+
+private:
+    struct FreeBlock {
+        FreeBlock *next_;
+    };
+    // A thread's private cache of free blocks for one Slab.
+    struct Cache {
+        FreeBlock *head_ = nullptr;
+        std::size_t n_ = 0;
+        Slab *slab_ = nullptr;
+        std::uint64_t hits_ = 0;    // Not yet added to slab_->cache_hits_
+        ~Cache();
+    };
+
+    const std::size_t objsize_;
+    const std::size_t align_;
+    const unsigned id_;         // Index into each thread's caches
+
+    std::mutex lock_;           // Protects free_, nfree_ and chunks_
+    FreeBlock *free_ = nullptr;
+    std::size_t nfree_ = 0;
+    std::vector<void *> chunks_;
+
+    std::atomic<std::uint64_t> allocs_{0};
+    std::atomic<std::uint64_t> cache_hits_{0};
+    std::atomic<std::uint64_t> refills_{0};
+    std::atomic<std::uint64_t> grows_{0};
+
+    Cache &cache();
+    // Carve a new chunk into blocks on the shared list.  Caller must
+    // hold lock_.
+    void grow(std::size_t nblocks);
+    // Move up to n blocks between a cache and the shared list.
+    void refill(Cache &c, std::size_t n);
+    void drain(Cache &c, std::size_t n);
+};
+
+// Slab of page-sized, page-aligned blocks, used for scratch buffers
+// by the encryption and paging I/O paths.
+Slab &page_slab();
+
+// A scratch buffer of len bytes, taken from a Slab when it fits in
+// one block and from the heap otherwise.
+class SlabBuffer {
+public:
+    SlabBuffer(Slab &slab, std::size_t len)
+        : slab_(len <= slab.object_size() ? &slab : nullptr),
+          p_(slab_ ? static_cast<std::uint8_t *>(slab_->alloc())
+                   : new std::uint8_t[len]) {}
+    ~SlabBuffer() {
+        if (slab_)
+            slab_->free(p_);
+        else
+            delete[] p_;
+    }
+    SlabBuffer(const SlabBuffer &) = delete;
+    SlabBuffer &operator=(const SlabBuffer &) = delete;
+
+    std::uint8_t *get() { return p_; }
+
+private:
+    Slab *const slab_;
+    std::uint8_t *const p_;
+};
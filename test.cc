@@ -1,13 +1,22 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "mcryptfile.hh"
+#include "slab.hh"
 
 static const char *data = "00000111112222233333444445555566666777778888899999";
 
@@ -146,6 +155,18 @@ void write_test()
             read_file("__test__", "12345").c_str());
 }
 
+void write_faults_test()
+{
+    printf("Mapping new file\n");
+    MCryptFile f(Key("12345"), "__test__");
+    char *p = f.map(3*page_size);
+    printf("Writing 3 memory-mapped pages\n");
+    for (int i = 0; i < 3; i++) {
+        fill_page(p + i*page_size, "write_test", i);
+    }
+    printf("Page faults: %d\n", f.faults.load());
+}
+
 void update_test()
 {
     printf("Creating file with 2 pages\n");
@@ -227,6 +248,334 @@ void remap_test()
             f.pread_bytes/page_size, f.pwrite_bytes/page_size);
 }
 
+void reopen_test()
+{
+    printf("Creating file with 3 pages\n");
+    write_file("__test__", 3, "99999");
+    int reads = 0;
+    for (int i = 0; i < 2; i++) {
+        MCryptFile f(Key("99999"), "__test__");
+        char *p = f.map();
+        printf("Page 1 signature: %s\n", page_signature(p + page_size).c_str());
+        printf("Updating page 2\n");
+        memmove(p + 2*page_size + 2, i ? "2222" : "1111", 4);
+        printf("Unmapping, then remapping\n");
+        f.unmap();
+        p = f.map();
+        printf("Page 2 signature: %s\n", page_signature(p + 2*page_size).c_str());
+        printf("Closing file\n");
+        reads += f.pread_bytes/page_size;
+    }
+    printf("Page signatures in file:\n%s\n",
+            read_file("__test__", "99999").c_str());
+    printf("Pages read: %d\n", reads);
+}
+
+void grow_test()
+{
+    printf("Creating file with 2 pages\n");
+    write_file("__test__", 2, "99999");
+    MCryptFile f(Key("99999"), "__test__");
+    char *p = f.map();
+    printf("Mapped file; region has %lu bytes\n", f.map_size());
+    printf("Page 1 signature: %s\n", page_signature(p + page_size).c_str());
+    printf("Growing region to 4 pages\n");
+    f.resize(4*page_size);
+    printf("Region has %lu bytes; base %s\n", f.map_size(),
+            f.map_base() == p ? "unchanged" : "moved");
+    printf("Writing pages 2 and 3\n");
+    fill_page(p + 2*page_size, "new_info", 2);
+    fill_page(p + 3*page_size, "new_info", 3);
+    printf("Page 1 signature: %s\n", page_signature(p + page_size).c_str());
+    printf("Page faults: %d\n", f.faults.load());
+    printf("Shrinking region to 3 pages\n");
+    f.resize(3*page_size);
+    f.flush();
+    printf("Page signatures in file after flush:\n%s\n",
+            read_file("__test__", "99999").c_str());
+    printf("Paging I/O: %lu pages read, %lu pages written\n",
+            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
+}
+
+void flush_range_test()
+{
+    printf("Creating file with 20 pages\n");
+    write_file("__test__", 20, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    char *p = f.map();
+    printf("Updating pages 3 and 15\n");
+    memmove(p + 3*page_size + 2, "3333", 4);
+    memmove(p + 15*page_size + 2, "5555", 4);
+    printf("Flushing pages 0-9\n");
+    f.flush_range(0, 10*page_size);
+    printf("Paging I/O: %lu pages read, %lu pages written\n",
+            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
+    printf("Flushing everything asynchronously\n");
+    std::shared_future<void> done = f.flush_async();
+    done.get();
+    printf("Paging I/O: %lu pages read, %lu pages written\n",
+            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
+    printf("Flushing everything again\n");
+    f.flush();
+    printf("Paging I/O: %lu pages read, %lu pages written\n",
+            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
+    CryptFile cf(Key("12345"), "__test__");
+    char page[page_size];
+    for (int i : {3, 15}) {
+        cf.aligned_pread(page, page_size, i*page_size);
+        printf("Page %d in file: %.8s\n", i, page);
+    }
+}
+
+void flush_runs_test()
+{
+    // More runs than the flush threads can take at once.
+    const int num_runs = 2*MCryptFile::max_flush_threads + 4;
+    printf("Creating file with %d pages\n", 2*num_runs);
+    write_file("__test__", 2*num_runs, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    char *p = f.map();
+    printf("Updating every other page\n");
+    for (int i = 0; i < num_runs; i++) {
+        char tag[8];
+        snprintf(tag, sizeof(tag), "%04d", i);
+        memmove(p + 2*i*page_size + 2, tag, 4);
+    }
+    printf("Syncing\n");
+    f.flush();
+    printf("Paging I/O: %lu pages read, %lu pages written\n",
+            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
+    CryptFile cf(Key("12345"), "__test__");
+    char page[page_size];
+    int updated = 0;
+    for (int i = 0; i < num_runs; i++) {
+        char tag[8];
+        snprintf(tag, sizeof(tag), "%04d", i);
+        cf.aligned_pread(page, page_size, 2*i*page_size);
+        if (memcmp(page + 2, tag, 4) == 0) {
+            updated++;
+        }
+    }
+    printf("Updated pages in file: %d of %d\n", updated, num_runs);
+}
+
+void write_failure_test()
+{
+    printf("Setting memory size to 3 pages\n");
+    MCryptFile::set_memory_size(3);
+    printf("Creating file with 3 pages\n");
+    write_file("__test__", 3, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    printf("Mapping with region size %lu\n", 5*page_size);
+    char *p = f.map(5*page_size);
+    printf("Writing pages 2-4\n");
+    for (int i = 2; i < 5; i++) {
+        fill_page(p + i*page_size, "new_info", i);
+    }
+    // Partway into page 3, so that writing it comes up short.
+    printf("Limiting file size to 3 pages and 100 bytes\n");
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit old_limit, limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = 3*page_size + 100;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    printf("Reading pages 0 and 1, which evicts pages that can't be written\n");
+    printf("Page 0 signature: %s\n", page_signature(p).c_str());
+    printf("Page 1 signature: %s\n", page_signature(p + page_size).c_str());
+    printf("Syncing\n");
+    try {
+        f.flush();
+        printf("Flush succeeded\n");
+    } catch (const std::system_error &e) {
+        printf("Flush failed: %s\n", e.code().message().c_str());
+    }
+    printf("Lifting the limit and syncing again\n");
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    f.flush();
+    printf("Page signatures in file after flush:\n%s\n",
+            read_file("__test__", "12345").c_str());
+}
+
+void sector_writeback_test()
+{
+    MCryptFile::set_sector_writeback(true);
+    printf("Creating file with 2 pages\n");
+    write_file("__test__", 2, "99999");
+    MCryptFile f(Key("99999"), "__test__");
+    printf("Mapping with region size %lu\n", 3*page_size);
+    char *p = f.map(3*page_size);
+    printf("Updating bytes 2 and 3000 of page 1\n");
+    memmove(p + page_size + 2, "1111", 4);
+    memmove(p + page_size + 3000, "2222", 4);
+    printf("Writing page 2\n");
+    fill_page(p + 2*page_size, "new_info", 2);
+    printf("Syncing\n");
+    f.flush();
+    printf("Page signatures in file after flush:\n%s\n",
+            read_file("__test__", "99999").c_str());
+    printf("Paging I/O: %d bytes read, %d bytes written\n",
+            f.pread_bytes.load(), f.pwrite_bytes.load());
+}
+
+void shared_handles_test()
+{
+    printf("Creating file with 3 pages\n");
+    write_file("__test__", 3, "99999");
+    MCryptFile f1(Key("99999"), "__test__");
+    MCryptFile f2(Key("99999"), "__test__");
+    char *p1 = f1.map();
+    char *p2 = f2.map();
+    printf("Mapped file through two handles; regions %s\n",
+            p1 == p2 ? "same" : "distinct");
+    printf("Page 1 signature via handle 1: %s\n",
+            page_signature(p1 + page_size).c_str());
+    printf("Page 1 signature via handle 2: %s\n",
+            page_signature(p2 + page_size).c_str());
+    printf("Updating page 2 via handle 1, page 0 via handle 2\n");
+    memmove(p1 + 2*page_size + 2, "1111", 4);
+    memmove(p2 + 2, "2222", 4);
+    printf("Page 2 signature via handle 2: %s\n",
+            page_signature(p2 + 2*page_size).c_str());
+    printf("Page 0 signature via handle 1: %s\n",
+            page_signature(p1).c_str());
+    printf("Unmapping handle 1\n");
+    f1.unmap();
+    printf("Page signatures in file:\n%s\n",
+            read_file("__test__", "99999").c_str());
+    printf("Page 0 signature via handle 2: %s\n",
+            page_signature(p2).c_str());
+    printf("Paging I/O: %d pages read, %d pages written\n",
+            (f1.pread_bytes.load() + f2.pread_bytes.load())/int(page_size),
+            (f1.pwrite_bytes.load() + f2.pwrite_bytes.load())/int(page_size));
+}
+
+void shared_handles_late_test()
+{
+    printf("Creating file with 3 pages\n");
+    write_file("__test__", 3, "99999");
+    printf("Reserving 4 pages of address space per mapping\n");
+    MCryptFile::set_map_reserve(4*page_size);
+    MCryptFile f1(Key("99999"), "__test__");
+    char *p1 = f1.map();
+    printf("Reading pages 0-2 and updating page 1 via handle 1\n");
+    for (int i = 0; i < 3; i++) {
+        page_signature(p1 + i*page_size);
+    }
+    memmove(p1 + page_size + 2, "1111", 4);
+    int faults = f1.faults.load();
+    printf("Mapping handle 2\n");
+    MCryptFile f2(Key("99999"), "__test__");
+    char *p2 = f2.map();
+    printf("Page 1 signature via handle 2: %s\n",
+            page_signature(p2 + page_size).c_str());
+    printf("Reading pages 0-2 via handle 1 again\n");
+    for (int i = 0; i < 3; i++) {
+        page_signature(p1 + i*page_size);
+    }
+    printf("New faults on handle 1: %d\n", f1.faults.load() - faults);
+    MCryptFile f3(Key("12345"), "__test__");
+    try {
+        f3.map();
+        printf("Mapped handle 3 with another key\n");
+    } catch (const std::invalid_argument &e) {
+        printf("Mapping handle 3 with another key failed: %s\n", e.what());
+    }
+    MCryptFile f4(Key("99999"), "__test__");
+    try {
+        f4.map(8*page_size);
+        printf("Mapped handle 4 with 8 pages\n");
+    } catch (const std::length_error &e) {
+        printf("Mapping handle 4 with 8 pages failed: %s\n", e.what());
+    }
+}
+
+void shared_cache_test()
+{
+    MCryptFile::set_shared_cache(16);
+    printf("Creating file with 3 pages\n");
+    write_file("__test__", 3, "99999");
+    fflush(stdout);
+    if (fork() == 0) {
+        MCryptFile f(Key("99999"), "__test__");
+        char *p = f.map();
+        printf("Child: page 2 signature: %s\n",
+                page_signature(p + 2*page_size).c_str());
+        printf("Child: updating page 1\n");
+        memmove(p + page_size + 2, "1111", 4);
+        f.unmap();
+        printf("Child: paging I/O: %d pages read, %d pages written\n",
+                f.pread_bytes.load()/int(page_size), f.pwrite_bytes.load()/int(page_size));
+        fflush(stdout);
+        _exit(0);
+    }
+    wait(nullptr);
+    MCryptFile f(Key("99999"), "__test__");
+    char *p = f.map();
+    for (int i = 0; i < 3; i++) {
+        printf("Page %d signature: %s\n", i,
+                page_signature(p + i*page_size).c_str());
+    }
+    printf("Paging I/O: %d pages read\n", f.pread_bytes.load()/int(page_size));
+}
+
+void zero_pages_test()
+{
+    printf("Setting memory size to 5 pages\n");
+    MCryptFile::set_memory_size(5);
+    printf("Creating file with 2 pages\n");
+    write_file("__test__", 2, "99999");
+    MCryptFile f(Key("99999"), "__test__");
+    printf("Mapping with region size %lu\n", 100*page_size);
+    char *p = f.map(100*page_size);
+    printf("Reading pages 2-99\n");
+    int nonzero = 0;
+    for (std::size_t i = 2*page_size; i < 100*page_size; i++)
+        nonzero += p[i] != 0;
+    printf("Nonzero bytes: %d\n", nonzero);
+    printf("Writing page 50\n");
+    fill_page(p + 50*page_size, "new_info", 50);
+    printf("Unmapping, then remapping\n");
+    f.unmap();
+    p = f.map();
+    printf("File has %lu pages\n", f.file_size()/page_size);
+    printf("Page 10 signature: %s\n", page_signature(p + 10*page_size).c_str());
+    printf("Page 50 signature: %s\n", page_signature(p + 50*page_size).c_str());
+    printf("Paging I/O: %d pages read, %d pages written\n",
+            f.pread_bytes.load()/int(page_size), f.pwrite_bytes.load()/int(page_size));
+}
+
+void zero_pages_threads_test()
+{
+    const int num_pages = 2000;
+    const int num_threads = 16;
+    printf("Creating empty file\n");
+    write_file("__test__", 0, "99999");
+    MCryptFile f(Key("99999"), "__test__");
+    printf("Mapping with region size %lu\n", num_pages*page_size);
+    volatile char *p = f.map(num_pages*page_size);
+    printf("Reading all pages from %d threads\n", num_threads);
+    std::atomic<int> nonzero(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < num_pages; i++) {
+                int page = (i + t) % num_pages;
+                nonzero += p[page*page_size] != 0;
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    printf("Nonzero bytes: %d\n", nonzero.load());
+    printf("Unmapping\n");
+    f.unmap();
+    printf("File has %lu pages\n", f.file_size()/page_size);
+    printf("Paging I/O: %d pages read, %d pages written\n",
+            f.pread_bytes.load()/int(page_size), f.pwrite_bytes.load()/int(page_size));
+}
+
 void big_file_test()
 {
     printf("Setting memory size to 5 pages\n");
@@ -273,6 +622,119 @@ void two_files_test()
             f2.pread_bytes/page_size, f2.pwrite_bytes/page_size);
 }
 
+void clusters_test()
+{
+    const int num_pages = 100;
+    printf("Setting memory size to 64 pages, in clusters of 16 pages\n");
+    MCryptFile::set_memory_size(64);
+    MCryptFile::set_cluster_size(16*page_size);
+    printf("Creating file with %d pages\n", num_pages);
+    write_file("__test__", num_pages, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    char *p = f.map();
+    printf("Reading all pages from memory, in order\n");
+    int errors = 0;
+    char label[40];
+    for (int i = 0; i < num_pages; i++) {
+        snprintf(label, sizeof(label), "__test__, page %d", i);
+        if (strcmp(p + i*page_size, label) != 0) {
+            errors++;
+        }
+    }
+    printf("Errors seen in memory: %d\n", errors);
+    printf("Page faults: %d\n", f.faults.load());
+    printf("Paging I/O: %lu pages read, %lu pages written\n",
+            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
+    printf("Rewriting every page, then flushing\n");
+    for (int i = 0; i < num_pages; i++) {
+        fill_page(p + i*page_size, "rewrite", i);
+    }
+    f.flush();
+    CryptFile cf(Key("12345"), "__test__");
+    char page[page_size];
+    errors = 0;
+    for (int i = 0; i < num_pages; i++) {
+        cf.aligned_pread(page, page_size, i*page_size);
+        snprintf(label, sizeof(label), "rewrite, page %d", i);
+        if (strcmp(page, label) != 0) {
+            errors++;
+        }
+    }
+    printf("Errors in file after flush: %d\n", errors);
+    printf("File size: %lu pages\n", cf.file_size()/page_size);
+}
+
+void resize_test()
+{
+    const int num_pages = 40;
+    printf("Setting memory size to 10 pages, at most 40 pages\n");
+    MCryptFile::set_memory_size(10);
+    MCryptFile::set_max_memory_size(40);
+    printf("Creating file with %d pages\n", num_pages);
+    write_file("__test__", num_pages, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    char *p = f.map();
+    auto check = [&](const char *what) {
+        int errors = 0;
+        char label[40];
+        for (int i = 0; i < num_pages; i++) {
+            snprintf(label, sizeof(label), "%s, page %d", what, i);
+            if (strcmp(p + i*page_size, label) != 0) {
+                errors++;
+            }
+        }
+        printf("Errors seen in memory: %d\n", errors);
+    };
+    check("__test__");
+    printf("Growing memory to 40 pages\n");
+    MCryptFile::set_memory_size(40);
+    check("__test__");
+    int faults = f.faults;
+    check("__test__");
+    printf("Page faults reading again: %d\n", f.faults - faults);
+    printf("Rewriting every page\n");
+    for (int i = 0; i < num_pages; i++) {
+        fill_page(p + i*page_size, "rewrite", i);
+    }
+    int written = f.pwrite_bytes;
+    printf("Shrinking memory to 10 pages\n");
+    MCryptFile::set_memory_size(10);
+    printf("Pages written while shrinking: %lu\n",
+            (f.pwrite_bytes - written)/page_size);
+    check("rewrite");
+}
+
+void buddy_test()
+{
+    printf("Creating pool of 24 pages\n");
+    PhysMem pm(24);
+    PPage base = pm.pool_base();
+    printf("Allocating runs of 1, 3, 8 and 2 pages\n");
+    std::vector<PPage> runs;
+    int misaligned = 0;
+    for (std::size_t n : {1, 3, 8, 2}) {
+        PPage p = pm.page_alloc(n);
+        std::size_t size = 1;
+        while (size < n)
+            size *= 2;
+        if (!p || (p - base) / page_size % size != 0)
+            misaligned++;
+        runs.push_back(p);
+    }
+    printf("Misaligned runs: %d\n", misaligned);
+    printf("Free pages: %lu\n", pm.nfree());
+    printf("Run of 16 pages available: %s\n",
+            pm.page_alloc(16) ? "yes" : "no");
+    printf("Freeing all runs\n");
+    for (PPage p : runs)
+        pm.page_free(p);
+    printf("Free pages: %lu\n", pm.nfree());
+    PPage p = pm.page_alloc(16);
+    printf("Run of 16 pages available: %s\n", p ? "yes" : "no");
+    if (p)
+        pm.page_free(p);
+}
+
 void random_test()
 {
     // The most recent value written in each page, used to check
@@ -315,6 +777,199 @@ void random_test()
 //            f.pread_bytes/page_size, f.pwrite_bytes/page_size);
 }
 
+void threads_test()
+{
+    const int num_pages = 20;
+    const int num_threads = 8;
+    // Each thread writes its own int slot (well past the page
+    // signature) so that threads never race on the same bytes.
+    const int slot_base = 64;
+    int last_written[num_threads][num_pages];
+
+    printf("Setting memory size to 5 pages\n");
+    MCryptFile::set_memory_size(5);
+    printf("Creating file with %d pages\n", num_pages);
+    write_file("__test__", num_pages, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    volatile char *p = f.map();
+    printf("Accessing pages from %d threads, sometimes writing\n",
+            num_threads);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            unsigned seed = t;
+            for (int page = 0; page < num_pages; page++) {
+                last_written[t][page] = -1;
+            }
+            for (int i = 0; i < 500; i++) {
+                int page = rand_r(&seed) % num_pages;
+                volatile int *slot = reinterpret_cast<volatile int *>(
+                        p + page*page_size) + slot_base + t;
+                if (rand_r(&seed) & 1) {
+                    *slot = i;
+                    last_written[t][page] = i;
+                } else if (last_written[t][page] >= 0
+                        && *slot != last_written[t][page]) {
+                    errors++;
+                }
+                char label[20];
+                snprintf(label, sizeof(label), "__test__, page %d", page);
+                for (size_t j = 0; label[j]; j++) {
+                    if (p[page*page_size + j] != label[j]) {
+                        errors++;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    printf("Errors seen by threads: %d\n", errors.load());
+    printf("Syncing\n");
+    f.flush();
+
+    CryptFile cf(Key("12345"), "__test__");
+    char page[page_size];
+    int file_errors = 0;
+    for (int i = 0; i < num_pages; i++) {
+        cf.aligned_pread(page, page_size, i*page_size);
+        for (int t = 0; t < num_threads; t++) {
+            int actual = reinterpret_cast<int *>(page)[slot_base + t];
+            if (last_written[t][i] >= 0 && actual != last_written[t][i]) {
+                file_errors++;
+            }
+        }
+    }
+    printf("Errors in file after flush: %d\n", file_errors);
+}
+
+void region_churn_test()
+{
+    const int num_pages = 20;
+    const int num_threads = 4;
+    const int num_maps = 200;
+
+    printf("Setting memory size to 5 pages\n");
+    MCryptFile::set_memory_size(5);
+    printf("Creating 2 files with %d pages each\n", num_pages);
+    write_file("__test__", num_pages, "12345");
+    write_file("__test2__", num_pages, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    volatile char *p = f.map();
+    printf("Reading pages from %d threads while mapping and unmapping "
+            "the other file %d times\n", num_threads, num_maps);
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            unsigned seed = t;
+            while (!done) {
+                int page = rand_r(&seed) % num_pages;
+                char label[20];
+                snprintf(label, sizeof(label), "__test__, page %d", page);
+                for (size_t j = 0; label[j]; j++) {
+                    if (p[page*page_size + j] != label[j]) {
+                        errors++;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    int map_errors = 0;
+    for (int i = 0; i < num_maps; i++) {
+        MCryptFile g(Key("12345"), "__test2__");
+        char *q = g.map();
+        int page = i % num_pages;
+        char label[20];
+        snprintf(label, sizeof(label), "__test2__, page %d", page);
+        if (strncmp(q + page*page_size, label, strlen(label)) != 0) {
+            map_errors++;
+        }
+    }
+    done = true;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    printf("Errors seen by threads: %d\n", errors.load());
+    printf("Errors seen through the other file: %d\n", map_errors);
+}
+
+void threads_pagemap_test()
+{
+    printf("Tracking page use with pagemap\n");
+    MCryptFile::set_tracking(MCryptFile::Tracking::PAGEMAP);
+    threads_test();
+    printf("Tracking in use: %s\n",
+            MCryptFile::effective_tracking() == MCryptFile::Tracking::PAGEMAP
+            ? "pagemap" : "mprotect");
+}
+
+void threads_prefault_test()
+{
+    printf("Prefaulting the memory pool\n");
+    PoolOptions opts;
+    opts.prefault = true;
+    MCryptFile::set_pool_options(opts);
+    threads_test();
+}
+
+void threads_userfaultfd_test()
+{
+    printf("Delivering page faults through userfaultfd\n");
+    MCryptFile::set_fault_delivery(FaultDelivery::USERFAULTFD);
+    threads_test();
+    write_file("__test__", 1, "12345");
+    MCryptFile f(Key("12345"), "__test__");
+    f.map();
+    printf("Delivery in use: %s\n",
+            f.effective_delivery() == FaultDelivery::USERFAULTFD
+            ? "userfaultfd" : "signals");
+}
+
+// Not a correctness test: measures page fault throughput with 1
+// through 64 threads randomly touching a file much larger than the
+// memory pool, so that nearly every fault also has to evict.
+void fault_bench()
+{
+    const int num_pages = 16384;
+    // Same total work for every thread count.
+    const int total_touches = 16384;
+    MCryptFile::set_memory_size(2048);
+    write_file("__test__", num_pages, "12345");
+    for (int num_threads = 1; num_threads <= 64; num_threads *= 2) {
+        MCryptFile f(Key("12345"), "__test__");
+        volatile char *p = f.map();
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                unsigned seed = t;
+                for (int i = 0; i < total_touches/num_threads; i++) {
+                    (void) p[(rand_r(&seed) % num_pages)*page_size];
+                }
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        std::chrono::duration<double> secs =
+                std::chrono::steady_clock::now() - start;
+        std::size_t faults = f.pread_bytes/page_size;
+        printf("%2d threads: %lu faults in %.3f sec, %.0f faults/sec\n",
+                num_threads, faults, secs.count(), faults/secs.count());
+    }
+    Slab::Stats st = page_slab().stats();
+    printf("Page buffer slab: %lu allocs, %.1f%% thread cache hits, "
+            "%lu refills, %lu grows\n", st.allocs,
+            st.allocs ? 100.0*st.cache_hits/st.allocs : 0.0,
+            st.refills, st.grows);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -324,6 +979,8 @@ main(int argc, char **argv)
             read_test();
         } else if (strcmp(argv[i], "write") == 0) {
             write_test();
+        } else if (strcmp(argv[i], "write_faults") == 0) {
+            write_faults_test();
         } else if (strcmp(argv[i], "update") == 0) {
             update_test();
         } else if (strcmp(argv[i], "extend") == 0) {
@@ -332,18 +989,68 @@ main(int argc, char **argv)
             multiple_writes_test();
         } else if (strcmp(argv[i], "remap") == 0) {
             remap_test();
+        } else if (strcmp(argv[i], "reopen") == 0) {
+            reopen_test();
+        } else if (strcmp(argv[i], "grow") == 0) {
+            grow_test();
+        } else if (strcmp(argv[i], "flush_range") == 0) {
+            flush_range_test();
+        } else if (strcmp(argv[i], "flush_runs") == 0) {
+            flush_runs_test();
+        } else if (strcmp(argv[i], "write_failure") == 0) {
+            write_failure_test();
+        } else if (strcmp(argv[i], "sector_writeback") == 0) {
+            sector_writeback_test();
+        } else if (strcmp(argv[i], "shared_handles") == 0) {
+            shared_handles_test();
+        } else if (strcmp(argv[i], "shared_handles_late") == 0) {
+            shared_handles_late_test();
+        } else if (strcmp(argv[i], "shared_cache") == 0) {
+            shared_cache_test();
+        } else if (strcmp(argv[i], "zero_pages") == 0) {
+            zero_pages_test();
+        } else if (strcmp(argv[i], "zero_pages_threads") == 0) {
+            zero_pages_threads_test();
 
         // Tests for Project 6 (page replacement)
         } else if (strcmp(argv[i], "big_file") == 0) {
             big_file_test();
         } else if (strcmp(argv[i], "two_files") == 0) {
             two_files_test();
+        } else if (strcmp(argv[i], "clusters") == 0) {
+            clusters_test();
+        } else if (strcmp(argv[i], "resize") == 0) {
+            resize_test();
+        } else if (strcmp(argv[i], "buddy") == 0) {
+            buddy_test();
         } else if (strcmp(argv[i], "random") == 0) {
             random_test();
+        } else if (strcmp(argv[i], "threads") == 0) {
+            threads_test();
+        } else if (strcmp(argv[i], "region_churn") == 0) {
+            region_churn_test();
+        } else if (strcmp(argv[i], "threads_pagemap") == 0) {
+            threads_pagemap_test();
+        } else if (strcmp(argv[i], "threads_userfaultfd") == 0) {
+            threads_userfaultfd_test();
+        } else if (strcmp(argv[i], "threads_prefault") == 0) {
+            threads_prefault_test();
+
+        // Benchmarks (output varies from run to run)
+        } else if (strcmp(argv[i], "fault_bench") == 0) {
+            fault_bench();
         } else {
-            printf("No test named '%s'; choices are:\n  read\n  write\n  "
-                    "update\n  extend\n  multiple_writes\n  big_file\n  "
-                    "two_files\n  random\n", argv[i]);
+            printf("No test named '%s'; choices are:\n  "
+                    "read\n  write\n  write_faults\n  update\n  extend\n  "
+                    "multiple_writes\n  remap\n  reopen\n  grow\n  "
+                    "flush_range\n  flush_runs\n  write_failure\n  "
+                    "sector_writeback\n  shared_handles\n  "
+                    "shared_handles_late\n  shared_cache\n  zero_pages\n  "
+                    "zero_pages_threads\n  big_file\n  two_files\n  "
+                    "clusters\n  resize\n  buddy\n  random\n  threads\n  "
+                    "region_churn\n  threads_pagemap\n  "
+                    "threads_userfaultfd\n  threads_prefault\n  "
+                    "fault_bench\n", argv[i]);
         }
         unlink ("__test__");
         unlink ("__test2__");
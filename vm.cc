@@ -1,10 +1,19 @@
 
 #include <cstdio>
 #include <iostream>
+#include <thread>
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <ucontext.h>
+#if defined(__aarch64__)
+#include <asm/sigcontext.h>
+#endif
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -13,115 +22,554 @@
 
 const std::size_t page_size = get_page_size();
 
-itree<&VMRegion::base_, &VMRegion::baselink_> VMRegion::regions_;
-itree<&VMRegion::Mapping::va_,
-      &VMRegion::Mapping::valink_> VMRegion::pagemap_;
+std::atomic<VMRegion::IndexLeaf *> VMRegion::index_[];
+std::mutex VMRegion::regions_lock_;
+std::atomic<unsigned> VMRegion::epoch_;
+std::atomic<long> VMRegion::faults_in_progress_[2];
 
-VMRegion::Mapping::Mapping(VPage va)
-    : va_(va), pi_({nullptr, PROT_NONE})
+namespace {
+
+// The userfaultfd on which missing-page faults of all
+// FaultDelivery::USERFAULTFD regions are reported, or -1 if the
+// kernel won't give us one.  Unprivileged processes may only be
+// allowed one that handles faults taken in user mode.
+int
+missing_uffd()
+{
+    static const int fd = [] {
+        for (int flags : {0, UFFD_USER_MODE_ONLY}) {
+            unique_fd fd(syscall(SYS_userfaultfd, O_CLOEXEC|flags));
+            if (fd == -1)
+                continue;
+            uffdio_api api{};
+            api.api = UFFD_API;
+            if (ioctl(fd, UFFDIO_API, &api) == 0)
+                return fd.release();
+        }
+        return -1;
+    }();
+    return fd;
+}
+
+// Reserve nbytes of inaccessible address space starting at a
+// multiple of align (or just page-aligned if align is 0).
+VPage
+reserve(std::size_t nbytes, std::size_t align)
+{
+    if (align <= page_size)
+        return static_cast<VPage>(mmap(nullptr, nbytes, PROT_NONE,
+                                       MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+    // Over-allocate, then trim the excess on either side.
+    std::size_t len = (nbytes + page_size - 1) & ~(page_size - 1);
+    char *p = static_cast<char *>(mmap(nullptr, len + align - page_size,
+                                       PROT_NONE, MAP_ANONYMOUS|MAP_PRIVATE,
+                                       -1, 0));
+    if (p == MAP_FAILED)
+        return static_cast<VPage>(MAP_FAILED);
+    char *base = reinterpret_cast<char *>(
+        (std::uintptr_t(p) + align - 1) & ~std::uintptr_t(align - 1));
+    if (base > p)
+        munmap(p, base - p);
+    if (std::size_t tail = (p + len + align - page_size) - (base + len))
+        munmap(base + len, tail);
+    return base;
+}
+
+} // anonymous namespace
+
+VMRegion::VMRegion(std::size_t num_bytes, FaultHandler handler,
+                   FaultDelivery delivery, std::size_t align)
+    : base_(reserve(num_bytes, std::max(align, granule))),
+      nbytes_(num_bytes), handler_(std::move(handler)),
+      fn_(call_handler), arg_(this),
+      delivery_(delivery == FaultDelivery::USERFAULTFD && missing_uffd() != -1
+                ? FaultDelivery::USERFAULTFD : FaultDelivery::SIGNAL)
+{
+    init();
+}
+
+VMRegion::VMRegion(std::size_t num_bytes, FaultFn fn, void *arg,
+                   FaultDelivery delivery, std::size_t align)
+    : base_(reserve(num_bytes, std::max(align, granule))),
+      nbytes_(num_bytes), fn_(fn), arg_(arg),
+      delivery_(delivery == FaultDelivery::USERFAULTFD && missing_uffd() != -1
+                ? FaultDelivery::USERFAULTFD : FaultDelivery::SIGNAL)
 {
-    VMRegion::pagemap_.insert(this);
+    init();
 }
 
-VMRegion::VMRegion(std::size_t num_bytes, std::function<void(char *)> handler)
-    : base_(static_cast<VPage>(mmap(nullptr, num_bytes, PROT_NONE,
-                                    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0))),
-      nbytes_(num_bytes), handler_(std::move(handler))
+void
+VMRegion::init()
 {
     if (base_ == MAP_FAILED)
         threrror("mmap");
-    regions_.insert(this);
+    if (std::uintptr_t(base_) + nbytes_ > std::uintptr_t(1) << va_bits) {
+        munmap(base_, nbytes_);
+        throw std::out_of_range("VMRegion: address beyond region index");
+    }
+    if (delivery_ == FaultDelivery::USERFAULTFD) {
+        // Missing-page faults are only reported for pages that are
+        // accessible, so the reservation must become read/write.
+        std::size_t len = (nbytes_ + page_size - 1) & ~(page_size - 1);
+        if (!uffd_register(base_, len)
+            || mprotect(base_, len, PROT_READ|PROT_WRITE) == -1) {
+            int err = errno;
+            munmap(base_, nbytes_);
+            errno = err;
+            threrror("userfaultfd");
+        }
+        static std::once_flag thread_started;
+        std::call_once(thread_started, [] {
+            std::thread(uffd_thread).detach();
+        });
+    }
+    {
+        std::lock_guard<std::mutex> lk(regions_lock_);
+        set_index(base_, nbytes_, this);
+    }
 
-    static bool handler_installed;
-    if (!handler_installed) {
-	handler_installed = true;
+    static std::once_flag handler_installed;
+    std::call_once(handler_installed, [] {
 	struct sigaction sa;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_SIGINFO;
 	sa.sa_sigaction = &fault_handler;
 	if (sigaction(SIGSEGV, &sa, nullptr) == -1)
 	    threrror("sigaction");
-    }
+    });
 }
 
 VMRegion::~VMRegion()
 {
+    {
+        std::lock_guard<std::mutex> lk(regions_lock_);
+        set_index(base_, nbytes_, nullptr);
+        wait_for_faults();
+    }
     if (munmap(base_, nbytes_) == -1)
 	threrror("mmap");
-#ifndef NDEBUG
-    if (Mapping *m = pagemap_.lower_bound(base_))
-        // If this assertion fails, you tried to delete a region that
-        // still had mapped pages.
-        assert(m->va_ >= base_ + nbytes_);
-#endif // !NDEBUG
 }
 
 void
-VMRegion::map(VPage va, PPage pa, Prot prot)
+VMRegion::set_index(VPage base, std::size_t nbytes, VMRegion *r)
 {
-    assert(std::uintptr_t(va) % page_size == 0);
-    Mapping *m = pagemap_[va];
-    if (!m)
-        m = new Mapping(va);
-    update(m, {pa, prot});
+    std::size_t first = std::uintptr_t(base) >> granule_bits;
+    std::size_t last = (std::uintptr_t(base) + nbytes - 1) >> granule_bits;
+    for (std::size_t g = first; g <= last; g++) {
+        std::atomic<IndexLeaf *> &top = index_[g >> leaf_bits];
+        IndexLeaf *leaf = top.load(std::memory_order_relaxed);
+        if (!leaf) {
+            leaf = new IndexLeaf();
+            top.store(leaf, std::memory_order_release);
+        }
+        leaf->regions[g & (leaf_size - 1)].store(r, std::memory_order_release);
+    }
 }
 
 void
-VMRegion::unmap(VPage va)
+VMRegion::wait_for_faults()
 {
-    assert(std::uintptr_t(va) % page_size == 0);
-    Mapping *m = pagemap_[va];
-    if (m)
-        update(m, {nullptr, PROT_NONE});
+    // Faults register in the current epoch before they look at the
+    // index.  Once each epoch in turn has been retired and its count
+    // has drained, no fault that started earlier is left.
+    for (int i = 0; i < 2; i++) {
+        unsigned e = epoch_.load();
+        epoch_.store(e ^ 1);
+        while (faults_in_progress_[e].load())
+            std::this_thread::yield();
+    }
 }
 
-#include <stdio.h>
-
 void
-VMRegion::update(Mapping *m, PageInfo pi)
+VMRegion::call_handler(void *self, char *addr, bool write)
 {
-    if (pi == m->pi_)
-        return;
+    static_cast<VMRegion *>(self)->handler_(addr, write);
+}
 
-    if (pi.pa == nullptr) {
+void
+VMRegion::map(VPage va, PageInfo &pi, PPage pa, Prot prot)
+{
+    if (pa)
+        map_range(va, &pi, &pa, prot, 1);
+    else {
         // If you are deleting a mapping, protections need to be none.
-        assert(pi.prot == PROT_NONE);
-        if (m->pi_.pa) {
-            if (mmap(m->va_, page_size, PROT_NONE,
-                     MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED, -1, 0) == MAP_FAILED)
-                threrror("mmap");
-            --*refcount(m->pi_.pa);
-        }
-        delete m;
+        assert(prot == PROT_NONE);
+        unmap_range(va, &pi, 1);
     }
-    else if (pi.pa != m->pi_.pa) {
-        PhysMem *pm = PhysMem::find(pi.pa);
-        if(mmap(m->va_, page_size, pi.prot, MAP_SHARED|MAP_FIXED,
-                pm->fd_, pi.pa - pm->pool_) == MAP_FAILED)
+}
+
+void
+VMRegion::unmap(VPage va, PageInfo &pi)
+{
+    unmap_range(va, &pi, 1);
+}
+
+void
+VMRegion::map_range(VPage va, PageInfo *pis, const PPage *pas, Prot prot,
+                    std::size_t npages)
+{
+    assert(std::uintptr_t(va) % page_size == 0);
+    for (std::size_t i = 0; i < npages;) {
+        assert(pas[i]);
+        std::size_t n = 1;
+        if (pas[i] == pis[i].pa) {
+            // Pages already holding the right PPage only need new
+            // protections.
+            while (i + n < npages && pas[i + n] == pis[i + n].pa)
+                n++;
+            protect_range(va + i * page_size, pis + i, prot, n);
+            i += n;
+            continue;
+        }
+        PhysMem *pm = PhysMem::find(pas[i]);
+        while (i + n < npages && pas[i + n] != pis[i + n].pa
+               && pas[i + n] == pas[i] + n * page_size
+               && pas[i + n] < pm->pool_ + pm->size_)
+            n++;
+        if (mmap(va + i * page_size, n * page_size, prot, MAP_SHARED|MAP_FIXED,
+                 pm->fd_, pas[i] - pm->pool_) == MAP_FAILED)
             threrror("mmap");
-        ++*refcount(pi.pa);
-        if (m->pi_.pa)
-            --*refcount(m->pi_.pa);
-        m->pi_ = pi;
+        for (std::size_t j = i; j < i + n; j++) {
+            ++*refcount(pas[j]);
+            if (pis[j].pa)
+                --*refcount(pis[j].pa);
+            pis[j] = {pas[j], prot};
+        }
+        i += n;
     }
-    else if (pi.prot != m->pi_.prot) {
-        if (mprotect(m->va_, page_size, pi.prot) == -1)
+}
+
+void
+VMRegion::protect_range(VPage va, PageInfo *pis, Prot prot,
+                        std::size_t npages)
+{
+    assert(std::uintptr_t(va) % page_size == 0);
+    for (std::size_t i = 0; i < npages;) {
+        if (!pis[i].pa || pis[i].prot == prot) {
+            i++;
+            continue;
+        }
+        // One mprotect covers everything up to the last page needing
+        // a change before the next unmapped one.
+        std::size_t n = 1;
+        for (std::size_t j = i + 1; j < npages && pis[j].pa; j++)
+            if (pis[j].prot != prot)
+                n = j - i + 1;
+        if (mprotect(va + i * page_size, n * page_size, prot) == -1)
             threrror("mprotect");
-        m->pi_ = pi;
+        for (std::size_t j = i; j < i + n; j++)
+            pis[j].prot = prot;
+        i += n;
+    }
+}
+
+void
+VMRegion::unmap_range(VPage va, PageInfo *pis, std::size_t npages)
+{
+    assert(std::uintptr_t(va) % page_size == 0);
+    for (std::size_t i = 0; i < npages;) {
+        if (!pis[i].pa) {
+            i++;
+            continue;
+        }
+        std::size_t n = 1;
+        while (i + n < npages && pis[i + n].pa)
+            n++;
+        clear_pages(va + i * page_size, n);
+        for (std::size_t j = i; j < i + n; j++) {
+            --*refcount(pis[j].pa);
+            pis[j] = {};
+        }
+        i += n;
+    }
+}
+
+void
+VMRegion::clear_pages(VPage va, std::size_t npages)
+{
+    std::size_t len = npages * page_size;
+    if (mmap(va, len, PROT_NONE,
+             MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED, -1, 0) == MAP_FAILED)
+        threrror("mmap");
+    // Register the fresh (but still inaccessible) pages before
+    // opening them up, or an access in between would find an ordinary
+    // anonymous zero page.
+    if (delivery_ == FaultDelivery::USERFAULTFD
+        && (!uffd_register(va, len)
+            || mprotect(va, len, PROT_READ|PROT_WRITE) == -1))
+        threrror("userfaultfd");
+}
+
+namespace {
+
+// Older kernel headers predate asynchronous write protection and
+// PAGEMAP_SCAN (Linux 6.7), so supply the parts of the ABI we use.
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1<<13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC (1<<15)
+#endif
+#ifndef PAGEMAP_SCAN
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#define PAGE_IS_WRITTEN (1 << 1)
+#define PAGE_IS_PRESENT (1 << 3)
+#define PM_SCAN_WP_MATCHING (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC (1 << 1)
+
+struct page_region {
+    __u64 start;
+    __u64 end;
+    __u64 categories;
+};
+
+struct pm_scan_arg {
+    __u64 size;
+    __u64 flags;
+    __u64 start;
+    __u64 end;
+    __u64 walk_end;
+    __u64 vec;
+    __u64 vec_len;
+    __u64 max_pages;
+    __u64 category_inverted;
+    __u64 category_mask;
+    __u64 category_anyof_mask;
+    __u64 return_mask;
+};
+#endif // !PAGEMAP_SCAN
+
+// File descriptors used for fault-free tracking.  In asynchronous
+// mode, a userfaultfd never has any messages to read; it just makes
+// the kernel record stores to write-protected pages and unprotect
+// them on its own.
+struct Tracking {
+    unique_fd uffd;
+    unique_fd pagemap;
+    bool ok = false;
+
+    Tracking() {
+        uffd.set(syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK));
+        pagemap.set(open("/proc/self/pagemap", O_RDONLY|O_CLOEXEC));
+        if (uffd == -1 || pagemap == -1)
+            return;
+        uffdio_api api{};
+        api.api = UFFD_API;
+        api.features = UFFD_FEATURE_WP_ASYNC|UFFD_FEATURE_WP_UNPOPULATED;
+        if (ioctl(uffd, UFFDIO_API, &api) == -1)
+            return;
+        // Make sure PAGEMAP_SCAN exists too.
+        pm_scan_arg arg{};
+        arg.size = sizeof(arg);
+        ok = ioctl(pagemap, PAGEMAP_SCAN, &arg) != -1;
+    }
+};
+
+Tracking &
+tracking()
+{
+    static Tracking t;
+    return t;
+}
+
+} // anonymous namespace
+
+bool
+VMRegion::tracking_supported()
+{
+    return tracking().ok;
+}
+
+void
+VMRegion::track(VPage va, std::size_t npages)
+{
+    assert(std::uintptr_t(va) % page_size == 0);
+    int uffd = tracking().uffd;
+    uffdio_register reg{};
+    reg.range.start = std::uintptr_t(va);
+    reg.range.len = npages * page_size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1)
+        threrror("UFFDIO_REGISTER");
+    // Also protects the page if it is not yet populated, so that the
+    // first store is recorded.
+    uffdio_writeprotect wp{};
+    wp.range = reg.range;
+    wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+    if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+        threrror("UFFDIO_WRITEPROTECT");
+}
+
+VMRegion::Usage
+VMRegion::harvest(VPage va, std::size_t npages, bool reset_accessed)
+{
+    assert(std::uintptr_t(va) % page_size == 0);
+    // A page is accessed if the kernel has a mapping for it, and
+    // dirty if it is no longer write-protected.  The scan reprotects
+    // pages in the same step.  Each call reports one run of pages in
+    // the same state, and says where it stopped.
+    Usage u;
+    pm_scan_arg arg{};
+    arg.size = sizeof(arg);
+    arg.flags = PM_SCAN_WP_MATCHING|PM_SCAN_CHECK_WPASYNC;
+    arg.start = std::uintptr_t(va);
+    arg.end = arg.start + npages * page_size;
+    arg.vec_len = 1;
+    arg.category_anyof_mask = arg.return_mask =
+        PAGE_IS_WRITTEN|PAGE_IS_PRESENT;
+    while (arg.start < arg.end) {
+        page_region pr;
+        arg.vec = std::uintptr_t(&pr);
+        int n = ioctl(tracking().pagemap, PAGEMAP_SCAN, &arg);
+        if (n == -1)
+            threrror("PAGEMAP_SCAN");
+        if (n > 0) {
+            u.accessed = true;
+            u.dirty |= bool(pr.categories & PAGE_IS_WRITTEN);
+        }
+        arg.start = arg.walk_end;
     }
+    // Dropping the mapping is the only way to reset the accessed
+    // indication.  The data stays in the PhysMem pool, and the pages
+    // remain write-protected, unless a store slipped in after the
+    // scan, which is then forgotten along with the mapping.
+    if (reset_accessed && u.accessed
+        && madvise(va, npages * page_size, MADV_DONTNEED) == -1)
+        threrror("madvise");
+    return u;
 }
 
+void
+VMRegion::harvest_dirty(VPage va, std::size_t npages,
+                        const std::function<void(VPage, std::size_t)> &report)
+{
+    assert(std::uintptr_t(va) % page_size == 0);
+    // Only written pages match, so only they are reprotected.  Without
+    // PM_SCAN_CHECK_WPASYNC, parts of the range that are not tracked
+    // are passed over rather than failing the scan.
+    page_region prs[64];
+    pm_scan_arg arg{};
+    arg.size = sizeof(arg);
+    arg.flags = PM_SCAN_WP_MATCHING;
+    arg.start = std::uintptr_t(va);
+    arg.end = arg.start + npages * page_size;
+    arg.vec = std::uintptr_t(prs);
+    arg.vec_len = std::size(prs);
+    arg.category_mask = arg.category_anyof_mask = arg.return_mask =
+        PAGE_IS_WRITTEN;
+    while (arg.start < arg.end) {
+        int n = ioctl(tracking().pagemap, PAGEMAP_SCAN, &arg);
+        if (n == -1)
+            threrror("PAGEMAP_SCAN");
+        for (int i = 0; i < n; i++)
+            report(reinterpret_cast<VPage>(prs[i].start),
+                   (prs[i].end - prs[i].start) / page_size);
+        arg.start = arg.walk_end;
+    }
+}
+
+namespace {
+
+// Return true if the page fault described by the signal context ctx
+// was caused by a store, as reported by the hardware.
+bool
+is_write_fault(void *ctx)
+{
+    ucontext_t *uc = static_cast<ucontext_t *>(ctx);
+#if defined(__x86_64__)
+    // Bit 1 of the x86 page fault error code is set for writes.
+    return uc->uc_mcontext.gregs[REG_ERR] & 0x2;
+#elif defined(__aarch64__)
+    // The kernel appends an ESR record to the signal frame; the WnR
+    // bit of a data abort's syndrome is set for writes.
+    for (_aarch64_ctx *h = reinterpret_cast<_aarch64_ctx *>(
+             uc->uc_mcontext.__reserved);
+         h->magic; h = reinterpret_cast<_aarch64_ctx *>(
+             reinterpret_cast<char *>(h) + h->size))
+        if (h->magic == ESR_MAGIC)
+            return reinterpret_cast<esr_context *>(h)->esr & (1 << 6);
+    return false;
+#else
+    (void) uc;
+    return false;
+#endif
+}
+
+} // anonymous namespace
+
 void
 VMRegion::fault_handler(int sig, siginfo_t *info, void *ctx)
 {
-    VPage addr = static_cast<VPage> (info->si_addr);
-    VMRegion *r = regions_.upper_bound_prev(addr);
-    if (!r || addr >= r->base_ + r->nbytes_) {
+    handle_fault(static_cast<VPage>(info->si_addr), is_write_fault(ctx));
+}
+
+bool
+VMRegion::uffd_register(VPage va, std::size_t len)
+{
+    uffdio_register reg{};
+    reg.range.start = std::uintptr_t(va);
+    reg.range.len = len;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    return ioctl(missing_uffd(), UFFDIO_REGISTER, &reg) == 0;
+}
+
+void
+VMRegion::uffd_thread()
+{
+    int fd = missing_uffd();
+    for (;;) {
+        uffd_msg msg;
+        ssize_t n = read(fd, &msg, sizeof(msg));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n != sizeof(msg)) {
+            std::perror("userfaultfd read");
+            std::abort();
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        VPage addr = reinterpret_cast<VPage>(msg.arg.pagefault.address);
+        handle_fault(addr,
+                     msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE);
+        // The handler mapped the page over the registered range, so
+        // the faulting thread only needs waking to retry the access.
+        uffdio_range range;
+        range.start = std::uintptr_t(addr) & ~(page_size - 1);
+        range.len = page_size;
+        if (ioctl(fd, UFFDIO_WAKE, &range) == -1) {
+            std::perror("UFFDIO_WAKE");
+            std::abort();
+        }
+    }
+}
+
+void
+VMRegion::handle_fault(VPage addr, bool write)
+{
+    // Register in the current epoch before looking up the region, so
+    // that it cannot be destroyed until we are done (see
+    // wait_for_faults).  These atomics are lock-free, so this is safe
+    // in a signal handler.
+    unsigned epoch;
+    for (;;) {
+        epoch = epoch_.load();
+        faults_in_progress_[epoch]++;
+        if (epoch_.load() == epoch)
+            break;
+        faults_in_progress_[epoch]--;
+    }
+    std::uintptr_t g = std::uintptr_t(addr) >> granule_bits;
+    IndexLeaf *leaf = g >> leaf_bits < std::size(index_)
+        ? index_[g >> leaf_bits].load(std::memory_order_acquire) : nullptr;
+    VMRegion *r = leaf
+        ? leaf->regions[g & (leaf_size - 1)].load(std::memory_order_acquire) : nullptr;
+    if (!r || addr < r->base_ || addr >= r->base_ + r->nbytes_) {
 	std::fprintf(stderr, "page fault at invalid address %p\n", addr);
 	std::abort();
     }
     try {
-        r->handler_(addr);
+        r->fn_(r->arg_, addr, write);
     }
     catch (std::exception &e) {
 	// You can't throw C++ exceptions from a signal handler, so
@@ -133,6 +581,7 @@ VMRegion::fault_handler(int sig, siginfo_t *info, void *ctx)
 	std::cerr << "Non-std::exception thrown from page fault handler\n";
 	std::abort();
     }
+    faults_in_progress_[epoch]--;
 }
 
 int *
@@ -147,6 +596,11 @@ VMRegion::refcount(PPage pa)
 
 namespace {
 
+// Linux 5.14; older C libraries don't define it.
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 void
 close_on_exec(int fd)
 {
@@ -160,20 +614,10 @@ close_on_exec(int fd)
 void
 set_file_size(int fd, off_t size)
 {
-#if MISSING_POSIX_FALLOCATE
+    // The file stays sparse, so that creating even a huge pool is
+    // quick; PhysMem::prefault allocates its space.
     if (ftruncate(fd, size) == -1)
 	threrror("ftruncate");
-#else // !MISSING_POSIX_FALLOCATE
-    // We prefer to allocate disk space now so as to throw an
-    // exception in response to an error.  If we don't call fallocate,
-    // then an out-of-disk space or over-quota condition will result
-    // in confusing page faults at the time the pages are first
-    // accessed (and hence allocated on-demand by the kernel).
-    if (int err = posix_fallocate(fd, 0, size)) {
-	errno = err;
-	threrror("fallocate");
-    }
-#endif // !MISSING_POSIX_FALLOCATE
 }
 
 unique_fd
@@ -192,23 +636,44 @@ make_temp_file(off_t size)
 }
 
 std::size_t
-cache_size(int npages)
+cache_size(int npages, bool huge)
 {
     const std::ptrdiff_t max_pageno =
         std::numeric_limits<std::ptrdiff_t>::max() / get_page_size();
 
     if (npages < 0 || npages >= max_pageno)
 	throw std::domain_error("PhysMem: invalid number of pages requested");
-    return std::size_t(npages) * get_page_size();
+    std::size_t size = std::size_t(npages) * get_page_size();
+    // A hugetlb file must be a whole number of huge pages.
+    if (std::size_t hsize = huge ? PhysMem::huge_page_size() : 0)
+	size = (size + hsize - 1) / hsize * hsize;
+    return size;
+}
+
+// Create a sealed memfd of the given size, or return -1 (with errno
+// set) if the kernel won't give us one.
+unique_fd
+make_memfd(std::size_t size, unsigned flags)
+{
+    unique_fd fd(memfd_create("PhysMem", MFD_CLOEXEC|MFD_ALLOW_SEALING|flags));
+    if (fd == -1)
+	return fd;
+    if (ftruncate(fd, size) == -1)
+	threrror("ftruncate");
+    // Nobody can shrink the pool out from under its mappings.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) == -1)
+	threrror("F_ADD_SEALS");
+    return fd;
 }
 
+// Map the pool, or return nullptr (with errno set) on failure.
 char *
-map_temp_file(int fd, std::size_t size)
+map_pool(int fd, std::size_t size, const PoolOptions &opts)
 {
-    set_file_size(fd, size);
-    void *ret = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    void *ret = mmap(nullptr, size, PROT_READ|PROT_WRITE,
+		     MAP_SHARED | (opts.populate ? MAP_POPULATE : 0), fd, 0);
     if (ret == MAP_FAILED)
-	threrror("mmap");
+	return nullptr;
 
     // We don't want the contents of this file (which is our
     // "pseudo-physical memory") to be paged out to disk for two
@@ -218,15 +683,25 @@ map_temp_file(int fd, std::size_t size)
     // the cache.  Second, since the pages contain potentially
     // sensitive plaintext of encrypted files, you don't want these to
     // be written back to the underlying file system or swap partition
-    // where they could be extracted by forensic analysis.
+    // where they could be extracted by forensic analysis.  A memfd
+    // keeps them off the file system, and mlock keeps them out of
+    // swap.
     //
-    // To be polite, however, we don't try to lock more than 1 MiB of
-    // memory.  Furthermore, depending on system configuration, mlock
-    // could fail when you are not root.  Hence, we ignore any error.
-    // (If mlock succeeds, the memory will automatically be unlocked
-    // later by munmap, so we don't really care if it succeeded or
-    // not.)
-    if (size <= 0x10'0000)
+    // Unless asked to lock the whole pool, however, we are polite and
+    // don't try to lock more than 1 MiB of memory.  Furthermore,
+    // depending on system configuration, mlock could fail when you
+    // are not root.  Hence, we ignore any error in that case.  (If
+    // mlock succeeds, the memory will automatically be unlocked later
+    // by munmap, so we don't really care if it succeeded or not.)
+    if (opts.lock) {
+	if (mlock(ret, size) == -1) {
+	    int err = errno;
+	    munmap(ret, size);
+	    errno = err;
+	    return nullptr;
+	}
+    }
+    else if (size <= 0x10'0000)
 	mlock(ret, size);
 
     return static_cast<char *>(ret);
@@ -234,59 +709,308 @@ map_temp_file(int fd, std::size_t size)
 
 } // anonoymous namespace
 
-PhysMem::PhysMem(std::size_t npages)
+std::size_t
+PhysMem::huge_page_size()
+{
+    static const std::size_t size = [] {
+	std::size_t kb = 0;
+	if (FILE *fp = fopen("/proc/meminfo", "r")) {
+	    char line[128];
+	    while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+		    break;
+	    fclose(fp);
+	}
+	return kb * 1024;
+    }();
+    return size;
+}
+
+PhysMem::PhysMem(std::size_t npages, const PoolOptions &opts)
     : npages_(npages),
-      size_(cache_size(npages)),
-      fd_(make_temp_file(size_)),
-      pool_(map_temp_file(fd_, size_)),
+      size_(cache_size(npages, opts.huge_pages)),
+      huge_(opts.huge_pages && huge_page_size()),
+      pool_(nullptr),
       nfree_(npages),
-      free_pages_(nullptr),
-      refcounts_(npages, -1)
+      limit_(npages),
+      draining_(0),
+      bump_(0),
+      runs_(new std::uint8_t[npages]),
+      stop_prefault_(false),
+      refcounts_(new int[npages])
 {
-    pools().insert(this);
-    for (char *p = pool_ + size_; p != pool_;) {
-	p -= get_page_size();
-	FreePage *fp = FreePage::construct(p);
-	fp->next_ = free_pages_;
-	free_pages_ = fp;
+    // Hugetlb pages are reserved when the pool is mapped, so failure
+    // to get enough of them shows up here.
+    if (huge_ && (fd_ = make_memfd(size_, MFD_HUGETLB)) != -1)
+	pool_ = map_pool(fd_, size_, opts);
+    if (!pool_) {
+	huge_ = false;
+	fd_ = make_memfd(size_, 0);
+	// Kernels before 3.17 lack memfd_create.
+	if (fd_ == -1)
+	    fd_ = make_temp_file(size_);
+	if (!(pool_ = map_pool(fd_, size_, opts)))
+	    threrror("PhysMem pool");
     }
+
+    unsigned max_order = 0;
+    while (std::size_t(2) << max_order <= npages_)
+	max_order++;
+    free_runs_.assign(max_order + 1, nullptr);
+    // Ask for transparent huge pages to back large runs.  Not every
+    // kernel supports this, so ignore errors.
+    if (!huge_)
+	madvise(pool_, size_, MADV_HUGEPAGE);
+    pools().insert(this);
+    if (opts.prefault)
+	prefault_ = std::thread(&PhysMem::prefault, this);
 }
 
 PhysMem::~PhysMem()
 {
-    assert(nfree_ == npages_);
+    if (prefault_.joinable()) {
+	stop_prefault_ = true;
+	prefault_.join();
+    }
+    assert(nfree_ == limit_ && draining_ == 0);
     munmap(pool_, size_);
 }
 
+void
+PhysMem::prefault()
+{
+    // Work a chunk at a time, so as not to hold up page faults on the
+    // pool for long, and so the destructor need not wait long.
+    constexpr std::size_t chunk = 0x20'0000;
+    std::size_t end = limit() * page_size;
+    for (std::size_t off = 0; off < end && !stop_prefault_; off += chunk) {
+	std::size_t len = std::min(chunk, end - off);
+#if !MISSING_POSIX_FALLOCATE
+	// Allocating space up front avoids a SIGBUS on first access if
+	// memory (or the file system) runs out.  There is no one to report
+	// an error to here, so just stop.
+	if (posix_fallocate(fd_, off, len))
+	    return;
+#endif // !MISSING_POSIX_FALLOCATE
+	if (madvise(pool_ + off, len, MADV_POPULATE_WRITE) == -1)
+	    return;
+    }
+}
+
+void
+PhysMem::push_range(std::size_t begin, std::size_t end)
+{
+    while (begin < end) {
+	unsigned o = 0;
+	while (begin % (std::size_t(2) << o) == 0
+	       && begin + (std::size_t(2) << o) <= end)
+	    o++;
+	push_run(begin, o);
+	begin += std::size_t(1) << o;
+    }
+}
+
+bool
+PhysMem::bump(unsigned order)
+{
+    const std::size_t size = std::size_t(1) << order;
+    // Free the pages we skip to align the bump pointer.
+    std::size_t end = std::min((bump_ + size - 1) / size * size, limit_);
+    if (end + size > limit_)
+	return false;
+    end += size;
+    for (std::size_t i = bump_; i < end; i++) {
+	runs_[i] = 0;
+	refcounts_[i] = -1;
+    }
+    push_range(bump_, end - size);
+    push_run(end - size, order);
+    bump_ = end;
+    return true;
+}
+
+void
+PhysMem::lower_bump()
+{
+    // Each pass takes the run ending at bump_, if it is free.
+    for (bool found = true; found;) {
+	found = false;
+	for (unsigned k = 0; k < free_runs_.size()
+		&& (std::size_t(1) << k) <= bump_; k++) {
+	    std::size_t h = bump_ - (std::size_t(1) << k);
+	    if (h % (std::size_t(1) << k) == 0
+		&& runs_[h] == (run_free | (k + 1))) {
+		unlink_run(h, k);
+		bump_ = h;
+		found = true;
+		break;
+	    }
+	}
+    }
+}
+
+void
+PhysMem::punch(std::size_t begin, std::size_t end)
+{
+    // Not every file system can punch holes; then the memory just
+    // stays in use, so ignore errors.
+    if (begin < end)
+	fallocate(fd_, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		  begin * page_size, (end - begin) * page_size);
+}
+
+void
+PhysMem::set_limit(std::size_t npages)
+{
+    std::lock_guard<std::mutex> lk(lock_);
+    npages = std::min(npages, npages_);
+    if (npages >= limit_) {
+	if (draining_)
+	    throw std::logic_error("PhysMem: pages above the limit are still in use");
+	nfree_ += npages - limit_;
+	limit_ = npages;
+	return;
+    }
+
+    // Find the run containing page npages.
+    std::size_t i = npages;
+    for (unsigned k = 0; npages < bump_; k++) {
+	assert(k < free_runs_.size());
+	std::size_t h = npages & ~((std::size_t(1) << k) - 1);
+	if (runs_[h]
+	    && h + (std::size_t(1) << ((runs_[h] & ~run_free) - 1)) > npages) {
+	    i = h;
+	    break;
+	}
+    }
+
+    // Withdraw the free runs from npages up, and count the allocated
+    // ones as draining.
+    std::size_t withdrawn = 0;
+    for (; i < bump_;) {
+	unsigned order = (runs_[i] & ~run_free) - 1;
+	std::size_t end = i + (std::size_t(1) << order);
+	if (!(runs_[i] & run_free)) {
+	    if (i < npages)
+		npages = end;
+	    else
+		draining_ += end - i;
+	} else {
+	    unlink_run(i, order);
+	    push_range(i, std::min(npages, end));
+	    punch(std::max(i, npages), end);
+	    withdrawn += end - std::max(i, npages);
+	}
+	i = end;
+    }
+    if (bump_ < limit_) {
+	punch(std::max(bump_, npages), limit_);
+	withdrawn += limit_ - std::max(bump_, npages);
+    }
+    nfree_ -= withdrawn;
+    limit_ = npages;
+    bump_ = std::min(bump_, limit_);
+    lower_bump();
+}
+
+void
+PhysMem::push_run(std::size_t i, unsigned order)
+{
+    FreePage *fp = FreePage::construct(pool_ + i * page_size);
+    fp->prev_ = nullptr;
+    fp->next_ = free_runs_[order];
+    if (fp->next_)
+	fp->next_->prev_ = fp;
+    free_runs_[order] = fp;
+    runs_[i] = run_free | (order + 1);
+}
+
+void
+PhysMem::unlink_run(std::size_t i, unsigned order)
+{
+    assert(runs_[i] == (run_free | (order + 1)));
+    FreePage *fp = reinterpret_cast<FreePage *>(pool_ + i * page_size);
+    fp->check();
+    if (fp->prev_)
+	fp->prev_->next_ = fp->next_;
+    else
+	free_runs_[order] = fp->next_;
+    if (fp->next_)
+	fp->next_->prev_ = fp->prev_;
+    fp->destroy();
+    runs_[i] = 0;
+}
+
 PPage
-PhysMem::page_alloc()
+PhysMem::page_alloc(std::size_t npages)
 {
-    // Get the next free page, or return nullptr if none are left.
-    FreePage *fp = free_pages_;
-    if (!fp)
-	return nullptr;
-    free_pages_ = fp->next_;
-    PPage p = fp->destroy();
-    --nfree_;
-    int *c = refcount(p);
-    assert(*c == -1);
-    *c = 0;
-    return p;
+    unsigned order = 0;
+    while (std::size_t(1) << order < npages)
+	order++;
+
+    // Take the smallest free run that is big enough, carving a new
+    // one from never-used pages if there is none, or return nullptr
+    // if the pool is exhausted.
+    std::lock_guard<std::mutex> lk(lock_);
+    unsigned k = order;
+    while (k < free_runs_.size() && !free_runs_[k])
+	k++;
+    if (k >= free_runs_.size()) {
+	if (order >= free_runs_.size() || !bump(order))
+	    return nullptr;
+	k = order;
+    }
+    std::size_t i = (reinterpret_cast<PPage>(free_runs_[k]) - pool_) / page_size;
+    unlink_run(i, k);
+
+    // Split off and free the upper halves we don't need.
+    while (k > order) {
+	k--;
+	push_run(i + (std::size_t(1) << k), k);
+    }
+    runs_[i] = order + 1;
+    nfree_ -= std::size_t(1) << order;
+    for (std::size_t j = 0; j < std::size_t(1) << order; j++) {
+	assert(refcounts_[i + j] == -1);
+	refcounts_[i + j] = 0;
+    }
+    return pool_ + i * page_size;
 }
 
 void
 PhysMem::page_free(PPage p)
 {
     assert(std::uintptr_t(p)%page_size == 0);
-
-    int *c = refcount(p);
-    // If this assertion fails, the page was already free or the page
-    // was still mapped at one or more VAddrs.
-    assert(*c == 0);
-    *c = -1;
-
-    FreePage *fp = FreePage::construct(p);
-    fp->next_ = free_pages_;
-    free_pages_ = fp;
-    ++nfree_;
+    std::size_t i = (p - pool_) / page_size;
+
+    std::lock_guard<std::mutex> lk(lock_);
+    // If this assertion fails, p was not returned by page_alloc or
+    // was already freed.
+    assert(runs_[i] != 0 && !(runs_[i] & run_free));
+    unsigned order = runs_[i] - 1;
+    for (std::size_t j = 0; j < std::size_t(1) << order; j++) {
+	// If this assertion fails, the page was still mapped at one or
+	// more VAddrs.
+	assert(refcounts_[i + j] == 0);
+	refcounts_[i + j] = -1;
+    }
+    runs_[i] = 0;
+    if (i >= limit_) {
+	draining_ -= std::size_t(1) << order;
+	punch(i, i + (std::size_t(1) << order));
+	return;
+    }
+    nfree_ += std::size_t(1) << order;
+
+    // Merge with the buddy as long as it is free and whole.
+    while (order + 1 < free_runs_.size()) {
+	std::size_t buddy = i ^ (std::size_t(1) << order);
+	if (buddy >= bump_ || runs_[buddy] != (run_free | (order + 1)))
+	    break;
+	unlink_run(buddy, order);
+	i = std::min(i, buddy);
+	order++;
+    }
+    push_run(i, order);
+    lower_bump();
 }
@@ -1,9 +1,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <cerrno>
 #include <functional>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <signal.h>
 #include <sys/mman.h>
@@ -53,6 +57,34 @@ using Prot = int;
 
 class PhysMem;
 
+// Page fault handler for a VMRegion.  It is called with the faulting
+// address and with write set to true if the access was a store.
+// (When the hardware does not say, write is false, so a store may
+// fault a second time after the handler grants only read access.)
+using FaultHandler = std::function<void(char *addr, bool write)>;
+// The same as a plain function and the argument to pass it, which the
+// fault path can call without going through a std::function.
+using FaultFn = void (*)(void *arg, char *addr, bool write);
+// Whether the hardware says which faults are stores on this platform.
+#if defined(__x86_64__) || defined(__aarch64__)
+constexpr bool faults_report_writes = true;
+#else
+constexpr bool faults_report_writes = false;
+#endif
+
+// How page faults on a VMRegion reach its FaultHandler.
+enum class FaultDelivery {
+    // From a SIGSEGV handler, on the faulting thread.
+    SIGNAL,
+    // Faults on pages that are not mapped at all are reported through
+    // userfaultfd(2) and handled on a dedicated thread, while the
+    // faulting thread sleeps in the kernel.  This also resolves faults
+    // taken by system calls (e.g., read(2) into the region), which
+    // would otherwise fail with EFAULT.  Protection faults on mapped
+    // pages still arrive as SIGSEGV.
+    USERFAULTFD,
+};
+
 // A region of virtual memory.  Until you explicitly map physical
 // pages there, a VMRegion has no memory and will generate page faults
 // if you access any of its pages.  However, the virtual address range
@@ -63,14 +95,28 @@ class VMRegion {
 public:
     const VPage base_;
     const std::size_t nbytes_;
-    const std::function<void(char *)> handler_;
+    const FaultHandler handler_;
+    const FaultFn fn_;
+    void *const arg_;
+    const FaultDelivery delivery_;
 
     // Allocate a region of virtual memory of size bytes.  Call
     // handler with the address of any page faults within the region.
     // Nbytes doesn't need to be a multiple of page_size, but if it
     // isn't, the portion of the last virtual page above size will not
-    // trigger page faults.
-    VMRegion(std::size_t nbytes, std::function<void(char *)> handler);
+    // trigger page faults.  If the kernel does not let us use
+    // userfaultfd, delivery falls back to FaultDelivery::SIGNAL.  If
+    // align is non-zero (it must be a power of two multiple of
+    // page_size), the region's base is a multiple of align, so that
+    // the kernel can map it with huge pages.  The base is always a
+    // multiple of granule.
+    VMRegion(std::size_t nbytes, FaultHandler handler,
+             FaultDelivery delivery = FaultDelivery::SIGNAL,
+             std::size_t align = 0);
+    // Like the above, but faults call fn(arg, addr, write).
+    VMRegion(std::size_t nbytes, FaultFn fn, void *arg,
+             FaultDelivery delivery = FaultDelivery::SIGNAL,
+             std::size_t align = 0);
 
     // Release a region of virtual memory.  It is an error to free a
     // region that still has mapped pages.
@@ -82,23 +128,17 @@ public:
         return base_;
     }
 
-    // Set the mapping for a particular VPage inside a VMRegion.  If a
-    // different page was previously mapped at VPage, the old mapping
-    // is discarded.  Otherwise, updates the protection bits.  If pa
-    // is nullptr (in which case prot must be PROT_NONE), then the
-    // mapping is removed.
-    static void map(VPage va, PPage pa, Prot prot);
-
-    // Unmap a VPage.
-    static void unmap(VPage va);
-
-private:
     // Data structure representing how a particular virtual is mapped.
     // Represents approximately the information that would be
-    // contained in a page table entry.
+    // contained in a page table entry.  VMRegion keeps no copy of
+    // this information itself; instead, whatever code manages a
+    // virtual page embeds its PageInfo (e.g., in its own page table
+    // entry) and passes it to map() and unmap(), which bring the
+    // mapping and the PageInfo up to date together.  The caller is
+    // responsible for serializing calls on the same PageInfo.
     struct PageInfo {
-        PPage pa;      // PPage backing a virtual page, or nullptr if none
-        Prot prot;     // Protection mode of the virtual page
+        PPage pa = nullptr;    // PPage backing a virtual page, or nullptr if none
+        Prot prot = PROT_NONE; // Protection mode of the virtual page
         bool operator==(const PageInfo &other) const {
             return pa == other.pa && prot == other.prot;
         }
@@ -107,49 +147,202 @@ private:
         }
     };
 
-    itree_entry baselink_;
-
-    // All regions, indexed by base virtual address
-    static itree<&VMRegion::base_, &VMRegion::baselink_> regions_;
-
-    // Data structure recording each VPage mapped to a PPage
-    struct Mapping {
-        const VPage va_;      // mapped here with pi_.prot protection
-        PageInfo pi_;
-        itree_entry valink_;
-
-        Mapping(VPage va);
+    // Set the mapping for a particular VPage inside a VMRegion, whose
+    // current state is pi.  If a different page was previously mapped
+    // at VPage, the old mapping is discarded.  Otherwise, updates the
+    // protection bits.  If pa is nullptr (in which case prot must be
+    // PROT_NONE), then the mapping is removed.
+    void map(VPage va, PageInfo &pi, PPage pa, Prot prot);
+
+    // Unmap a VPage whose current state is pi.
+    void unmap(VPage va, PageInfo &pi);
+
+    // Range versions of map() and unmap(), for the npages consecutive
+    // VPages starting at va, whose current states are pis[0..npages).
+    // Rather than making a system call per page, they make one per
+    // run of adjacent pages that can be changed together.
+    //
+    // map_range maps pas[i] at the ith page with protection prot.
+    // Every pas[i] must be non-null; runs of pages getting physically
+    // contiguous PPages of one PhysMem are mapped at once.
+    void map_range(VPage va, PageInfo *pis, const PPage *pas, Prot prot,
+                   std::size_t npages);
+    // Set the protection of every mapped page in the range to prot,
+    // leaving unmapped pages alone.
+    void protect_range(VPage va, PageInfo *pis, Prot prot,
+                       std::size_t npages);
+    // Unmap every page in the range.
+    void unmap_range(VPage va, PageInfo *pis, std::size_t npages);
+
+    // Fault-free tracking of page use.  Where the kernel supports it
+    // (asynchronous userfaultfd write protection and the PAGEMAP_SCAN
+    // ioctl, Linux 6.7 and later), a page can stay mapped read/write
+    // while the kernel records whether it has been loaded from or
+    // stored to, without ever delivering a page fault to us.  Returns
+    // false if this is not available.
+    static bool tracking_supported();
+
+    // Start tracking accesses to the npages pages at va, which must
+    // be mapped, as if they had not yet been accessed.  Because map()
+    // replaces the kernel's mapping whenever it installs a different
+    // PPage, this must be called again after every such map().
+    static void track(VPage va, std::size_t npages = 1);
+
+    // Accesses recorded for a tracked page.
+    struct Usage {
+        bool accessed = false; // Page loaded from or stored to
+        bool dirty = false;    // Page stored to
     };
 
-    // All page mappings, indexed by virtual page address
-    static itree<&Mapping::va_, &Mapping::valink_> pagemap_;
+    // Return the accesses recorded for the npages tracked pages at va
+    // since they were last reset (combined over all of them), and
+    // reset them.  The dirty indication is reset atomically, so no
+    // store is ever lost.  If reset_accessed is false, the accessed
+    // indication is left alone, since resetting it drops the kernel's
+    // mapping and costs the next access a (minor, kernel-internal)
+    // fault.  A store between the scan and the drop goes unrecorded,
+    // so writable pages should be protected first.
+    static Usage harvest(VPage va, std::size_t npages, bool reset_accessed);
+    // Call report(start, npages) for each run of pages in the npages
+    // pages at va that have been stored to since their dirty
+    // indication was last reset, and reset it.  Pages that are not
+    // mapped or not tracked are skipped, and, unlike harvest(), this
+    // takes one system call for many runs, so it is cheap to apply to
+    // a whole region.
+    static void harvest_dirty(VPage va, std::size_t npages,
+                              const std::function<void(VPage, std::size_t)> &report);
+
+    // Regions are aligned to granules of this many bytes, so that no
+    // two of them share a granule.
+    static constexpr unsigned granule_bits = 21;
+    static constexpr std::size_t granule = std::size_t(1) << granule_bits;
 
-    // Update a mapping if anything has changed
-    static void update(Mapping *m, PageInfo pi);
+private:
+    // Index from which the fault handler finds the region containing
+    // an address in constant time and without locks: a two-level
+    // radix table in which every granule a region overlaps points to
+    // the region.  Leaves are allocated on first use and never freed,
+    // and entries are updated with regions_lock_ held.  A region is
+    // not destroyed until every fault that may have found it in the
+    // index has finished (see handle_fault).
+    static constexpr unsigned va_bits = 47;    // User address space
+    static constexpr unsigned leaf_bits = 13;
+    static constexpr std::size_t leaf_size = std::size_t(1) << leaf_bits;
+    struct IndexLeaf {
+        std::atomic<VMRegion *> regions[leaf_size];
+    };
+    static std::atomic<IndexLeaf *>
+        index_[std::size_t(1) << (va_bits - granule_bits - leaf_bits)];
+    static std::mutex regions_lock_;
+    // Faults in progress, counted separately for each of two epochs.
+    static std::atomic<unsigned> epoch_;
+    static std::atomic<long> faults_in_progress_[2];
+
+    // Point the index entries of every granule of [base, base+nbytes)
+    // to r (which may be nullptr).
+    static void set_index(VPage base, std::size_t nbytes, VMRegion *r);
+    // Wait for every fault that started before the call.
+    static void wait_for_faults();
+    // Body of the constructors
+    void init();
+    // FaultFn that calls handler_
+    static void call_handler(void *self, char *addr, bool write);
+
+    // Replace whatever is mapped at the npages pages starting at va
+    // with inaccessible, unbacked memory.
+    void clear_pages(VPage va, std::size_t npages);
 
     // Signal handler for SIGSEGV (which gets called on page faults)
     static void fault_handler(int sig, siginfo_t *info, void *ctx);
 
+    // Register [va, va+len) for missing-page faults on the
+    // userfaultfd.  Returns false if userfaultfd is not available.
+    static bool uffd_register(VPage va, std::size_t len);
+    // Body of the thread serving userfaultfd faults
+    static void uffd_thread();
+    // Find the region containing addr and call its handler, aborting
+    // the process if there is none or the handler fails.
+    static void handle_fault(VPage addr, bool write);
+
     // Get refcount of a physical page
     static int *refcount(PPage pa);
 
     friend class PhysMem;
 };
 
+// How a PhysMem pool is backed and pinned in memory.
+struct PoolOptions {
+    // Back the pool with hugetlb pages (MFD_HUGETLB), falling back to
+    // ordinary pages if the system has too few to spare.  Every range
+    // of the pool that is mapped must then be aligned to
+    // PhysMem::huge_page_size().
+    bool huge_pages = false;
+    // Lock the whole pool into memory.  (Otherwise only pools of up to
+    // 1 MiB are locked, and only if mlock permits.)
+    bool lock = false;
+    // Fault in the whole pool before the constructor returns.
+    bool populate = false;
+    // Fault in the whole pool from a background thread.
+    bool prefault = false;
+};
+
 // PhysMem holds a fixed number of pseudo-physical pages that can be
 // mapped at arbitrary addresses in VMRegion.  Each pseudo-physical
 // page is backed by a real page of physical memory (modulo the
 // availability of the mlock system call) and can be accessed read or
 // write at its PPage pseudo-physical address.
+//
+// Pages are allocated in physically contiguous runs of 2^k pages,
+// aligned to their own size within the pool, by a buddy allocator
+// that merges a freed run with its free buddy.  A run can be mapped
+// with a single mmap, and, where the kernel supports it, backed by
+// huge pages.
+//
+// The pool lives in a sealed memfd, so its pages are never written
+// to a file system (and, if locked, not to swap either).  Its size is
+// fixed, but a limit on the number of pages in use can move within
+// it (see set_limit), with the unused part taking no memory.  Creating a
+// pool takes constant time unless opts.populate is set: the memfd
+// starts out empty, and pages are only handed to the allocator (and
+// their bookkeeping initialized) when a bump pointer first passes
+// them.
 class PhysMem {
 public:
-    PhysMem(std::size_t npages);
+    PhysMem(std::size_t npages, const PoolOptions &opts = PoolOptions());
     ~PhysMem();
 
+    // Size of the huge pages the pool uses with opts.huge_pages, or 0
+    // if the kernel does not support them.
+    static std::size_t huge_page_size();
+    // True if the pool is backed by hugetlb pages.
+    bool huge_pages() { return huge_; }
+
     std::size_t npages() { return npages_; } // Total number of pages
-    std::size_t nfree() { return nfree_; }   // Number of free pages
-    PPage page_alloc(); // Allocate a page, or return nullptr if out of pages.
-    void page_free(PPage p); // Free an allocated page (must not be mapped)
+    std::size_t nfree() {                    // Number of free pages
+        std::lock_guard<std::mutex> lk(lock_);
+        return nfree_;
+    }
+    std::size_t limit() {                    // Pages that may be in use
+        std::lock_guard<std::mutex> lk(lock_);
+        return limit_;
+    }
+    // Only allocate pages below npages (clamped to npages()), so that
+    // the pool can shrink and grow at run time.  Shrinking returns the
+    // memory of free pages above the new limit to the system at once,
+    // and that of allocated ones when they are freed; until then they
+    // are counted by draining().  The limit is rounded up so as not to
+    // split an allocated run.  Growing is only possible once
+    // draining() is zero; otherwise it throws std::logic_error.
+    void set_limit(std::size_t npages);
+    std::size_t draining() {                 // Allocated pages above limit
+        std::lock_guard<std::mutex> lk(lock_);
+        return draining_;
+    }
+    // Allocate a run of npages contiguous pages (rounded up to a power
+    // of two), or return nullptr if no free run is large enough.
+    PPage page_alloc(std::size_t npages = 1);
+    // Free a run returned by page_alloc (none of its pages may be mapped)
+    void page_free(PPage p);
     
     // PPages managed by this object have contiguous addresses; this
     // returns the address of the first (lowest) page.
@@ -160,9 +353,14 @@ public:
 private:
     const std::size_t npages_;  // Total number of pages in pool
     const std::size_t size_;    // Size of memory pool in bytes
-    const unique_fd fd_;        // Temporary file containing pages
-    const PPage pool_;          // Pool of pseudo-physical memory
-    std::size_t nfree_;         // Number of available pages
+    bool huge_;                 // Backed by hugetlb pages
+    unique_fd fd_;              // Memfd (or temporary file) containing pages
+    PPage pool_;                // Pool of pseudo-physical memory
+    std::mutex lock_;           // Protects everything below
+    std::size_t nfree_;         // Number of available pages below limit_
+    std::size_t limit_;         // Pages from here on may not be allocated
+    std::size_t draining_;      // Allocated pages at or above limit_
+    std::size_t bump_;          // Pages from here on were never allocated
 
     itree_entry poollink_;
 
@@ -187,10 +385,11 @@ private:
         return pm;
     }
 
-    // We keep free pages in a singly linked list.  To catch some
-    // egregious use-after-free bugs, we sandwich the next pointer
-    // between two randomly generated constants and periodically check
-    // that these constants have not been overwritten.
+    // We keep free runs of each order in a doubly linked list, so a
+    // buddy can be unlinked when it is merged.  To catch some
+    // egregious use-after-free bugs, we sandwich the pointers between
+    // two randomly generated constants and periodically check that
+    // these constants have not been overwritten.
     struct FreePage {
         // These are just random constants for detecting corruption.
         static constexpr uint64_t MAGIC1 = 0xb587a9ce779288b5;
@@ -199,6 +398,7 @@ private:
 
         volatile uint64_t magic1_;
         FreePage *next_;
+        FreePage *prev_;
         volatile uint64_t magic2_;
 
         FreePage() : magic1_(MAGIC1), magic2_(MAGIC2) {}
@@ -218,9 +418,34 @@ private:
             return ret;
         }
     };
-    FreePage *free_pages_;
-
-    std::vector<int> refcounts_;
+    // free_runs_[k] lists the free runs of 2^k pages.
+    std::vector<FreePage *> free_runs_;
+
+    // For the first page of each run, run_free | (order + 1); zero
+    // for every other page.  Like refcounts_, only initialized below
+    // bump_.
+    static constexpr std::uint8_t run_free = 0x80;
+    std::unique_ptr<std::uint8_t[]> runs_;
+
+    void push_run(std::size_t i, unsigned order);
+    void unlink_run(std::size_t i, unsigned order);
+    // Push maximal aligned runs covering pages [begin, end).
+    void push_range(std::size_t begin, std::size_t end);
+    // Move pages from the bump pointer to the free lists until there
+    // is a free run of the given order.  Returns false if the pool
+    // is exhausted.
+    bool bump(unsigned order);
+    // Give free runs just below the bump pointer back to the
+    // never-used pages, so they can form the largest runs again.
+    void lower_bump();
+    // Return the memory of pages [begin, end) to the system.
+    void punch(std::size_t begin, std::size_t end);
+
+    std::atomic<bool> stop_prefault_;
+    std::thread prefault_;      // Background thread faulting in the pool
+    void prefault();
+
+    std::unique_ptr<int[]> refcounts_;
     int *refcount(PPage p) {
         // If this assertion fails, you tried to use a PPage that was
         // not allocated by this PhysMem object.